@@ -0,0 +1,141 @@
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "adapt.h"
+
+#define TAG "ADAPT"
+
+// A level is left for a more robust one after DEGRADE_REPORTS bad reports in
+// a row, and only recovered after RECOVER_REPORTS good ones and a minimum
+// dwell time, so a link hovering around one threshold cannot make it flap.
+#define LOSS_HIGH 0.02f
+#define LOSS_LOW 0.005f
+#define JITTER_HIGH_MS 20.0f
+#define JITTER_LOW_MS 5.0f
+#define DEGRADE_REPORTS 2
+#define RECOVER_REPORTS 5
+#define MIN_DWELL_US (10 * 1000000LL)
+
+static const adapt_level_t levels[] = {
+    { "nominal", 0, 0, 1 },
+    { "batched", 240, 720, 1 },
+    { "half-rate", 240, 720, 2 },
+};
+
+static portMUX_TYPE adapt_lock = portMUX_INITIALIZER_UNLOCKED;
+static adapt_apply_t apply_cb;
+static int max_lvl;
+static int bad_run, good_run;
+static int64_t last_change_us;
+// The applied level is the more robust of what receiver feedback asks for and
+// the floor set from local link quality.
+static int feedback_lvl, floor_lvl;
+static adapt_stats_t stats;
+
+void adapt_init(adapt_apply_t apply, int max_level)
+{
+    int n = sizeof(levels) / sizeof(levels[0]);
+
+    apply_cb = apply;
+    max_lvl = max_level < n ? max_level : n - 1;
+    bad_run = good_run = 0;
+    feedback_lvl = floor_lvl = 0;
+    last_change_us = esp_timer_get_time();
+    memset(&stats, 0, sizeof(stats));
+    stats.last_reason = "init";
+}
+
+/* Called with adapt_lock held, so levels are computed and handed to apply_cb
+ * in the order the state changed even when the linkmon and websocket tasks
+ * report at the same time. Returns the new level, or -1 if it didn't change. */
+static int update_level_locked(const char *reason)
+{
+    int level = feedback_lvl > floor_lvl ? feedback_lvl : floor_lvl;
+
+    if (level > max_lvl) level = max_lvl;
+    if (level == stats.level) return -1;
+    stats.level = level;
+    stats.changes++;
+    stats.last_reason = reason;
+    if (apply_cb) apply_cb(&levels[level]);
+    return level;
+}
+
+static void log_level(int level, const char *reason, float loss, float jitter_ms)
+{
+    if (level < 0) return;
+    ESP_LOGW(TAG, "-> %s (%s, loss %.1f%%, jitter %.1f ms)", levels[level].name, reason,
+             loss * 100.0f, jitter_ms);
+}
+
+static int set_feedback_level_locked(int level, const char *reason)
+{
+    feedback_lvl = level;
+    bad_run = good_run = 0;
+    last_change_us = esp_timer_get_time();
+    return update_level_locked(reason);
+}
+
+void adapt_feedback(float loss, float jitter_ms)
+{
+    int bad = loss > LOSS_HIGH || jitter_ms > JITTER_HIGH_MS;
+    int good = loss < LOSS_LOW && jitter_ms < JITTER_LOW_MS;
+    int64_t now = esp_timer_get_time();
+    const char *reason = "";
+    int level = -1;
+
+    portENTER_CRITICAL(&adapt_lock);
+    stats.reports++;
+    stats.loss = loss;
+    stats.jitter_ms = jitter_ms;
+    bad_run = bad ? bad_run + 1 : 0;
+    good_run = good ? good_run + 1 : 0;
+
+    if (bad_run >= DEGRADE_REPORTS && feedback_lvl < max_lvl) {
+        reason = loss > LOSS_HIGH ? "loss" : "jitter";
+        level = set_feedback_level_locked(feedback_lvl + 1, reason);
+    }
+    else if (good_run >= RECOVER_REPORTS && feedback_lvl > 0
+             && now - last_change_us >= MIN_DWELL_US) {
+        reason = "recovered";
+        level = set_feedback_level_locked(feedback_lvl - 1, reason);
+    }
+    portEXIT_CRITICAL(&adapt_lock);
+    log_level(level, reason, loss, jitter_ms);
+}
+
+void adapt_set_floor(int level, const char *reason)
+{
+    adapt_stats_t s;
+
+    portENTER_CRITICAL(&adapt_lock);
+    floor_lvl = level;
+    level = update_level_locked(reason);
+    s = stats;
+    portEXIT_CRITICAL(&adapt_lock);
+    log_level(level, reason, s.loss, s.jitter_ms);
+}
+
+void adapt_set_max_level(int level)
+{
+    int n = sizeof(levels) / sizeof(levels[0]);
+    adapt_stats_t s;
+
+    portENTER_CRITICAL(&adapt_lock);
+    max_lvl = level < n ? level : n - 1;
+    if (feedback_lvl > max_lvl) feedback_lvl = max_lvl;
+    level = update_level_locked("codec");
+    s = stats;
+    portEXIT_CRITICAL(&adapt_lock);
+    log_level(level, "codec", s.loss, s.jitter_ms);
+}
+
+void adapt_get_stats(adapt_stats_t *out)
+{
+    portENTER_CRITICAL(&adapt_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&adapt_lock);
+}
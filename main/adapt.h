@@ -0,0 +1,29 @@
+#include <stdint.h>
+
+typedef struct {
+    const char *name;
+    int block;      // Capture block size, 0 keeps the configured profile.
+    int frames;     // Samples per datagram, 0 keeps the configured profile.
+    int decimate;   // Sample rate divider.
+} adapt_level_t;
+
+typedef struct {
+    int level;
+    uint32_t reports;
+    uint32_t changes;
+    float loss;         // Last reported loss fraction.
+    float jitter_ms;    // Last reported jitter.
+    const char *last_reason;
+} adapt_stats_t;
+
+// Runs inside adapt's critical section: only record the level and apply it
+// from the task that owns the stream.
+typedef void (*adapt_apply_t)(const adapt_level_t *level);
+
+void adapt_init(adapt_apply_t apply, int max_level);
+void adapt_feedback(float loss, float jitter_ms);
+// Lowest level to use regardless of receiver feedback, e.g. on a weak link.
+void adapt_set_floor(int level, const char *reason);
+// Most degraded level allowed, e.g. lowered when the codec can't change rate.
+void adapt_set_max_level(int level);
+void adapt_get_stats(adapt_stats_t *stats);
@@ -0,0 +1,56 @@
+#include <string.h>
+
+#include "afast_writer.h"
+
+/* {"data":"<base64 samples>","id":1,"client":"ESP32","type":"afast"}
+ * Written front to back straight into the caller's buffer, so there is no
+ * cJSON tree, no intermediate base64 buffer and no heap allocation. */
+#define AFAST_HEAD "{\"data\":\""
+#define AFAST_TAIL "\",\"id\":1,\"client\":\"ESP32\",\"type\":\"afast\"}"
+
+static const char b64_table[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t base64_encode_fast(char *out, const uint8_t *in, size_t len)
+{
+    char *p = out;
+    size_t i = 0;
+
+    // Whole 3 byte groups: one 24 bit word in, four table lookups out.
+    for (; i + 3 <= len; i += 3) {
+        uint32_t w = ((uint32_t)in[i] << 16) | ((uint32_t)in[i+1] << 8) | in[i+2];
+        p[0] = b64_table[(w >> 18) & 0x3F];
+        p[1] = b64_table[(w >> 12) & 0x3F];
+        p[2] = b64_table[(w >> 6) & 0x3F];
+        p[3] = b64_table[w & 0x3F];
+        p += 4;
+    }
+
+    if (i < len) {
+        uint32_t w = (uint32_t)in[i] << 16;
+        if (i + 1 < len) w |= (uint32_t)in[i+1] << 8;
+        p[0] = b64_table[(w >> 18) & 0x3F];
+        p[1] = b64_table[(w >> 12) & 0x3F];
+        p[2] = (i + 1 < len) ? b64_table[(w >> 6) & 0x3F] : '=';
+        p[3] = '=';
+        p += 4;
+    }
+
+    return p - out;
+}
+
+size_t afast_write(char *out, size_t cap, const uint16_t samps[], int n)
+{
+    size_t len = (sizeof(AFAST_HEAD) - 1) + BASE64_LEN(n * 2) + (sizeof(AFAST_TAIL) - 1);
+    char *p = out;
+
+    if (len + 1 > cap) return 0;
+
+    memcpy(p, AFAST_HEAD, sizeof(AFAST_HEAD) - 1);
+    p += sizeof(AFAST_HEAD) - 1;
+    // Samples are little-endian in memory, which is the byte order LedFx expects.
+    p += base64_encode_fast(p, (const uint8_t *)samps, n * 2);
+    memcpy(p, AFAST_TAIL, sizeof(AFAST_TAIL));
+
+    return len;
+}
@@ -0,0 +1,10 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#define BASE64_LEN(n) ((((n) + 2) / 3) * 4)
+
+/* Worst case size of an "afast" message carrying n samples. */
+#define AFAST_MSG_LEN(n) (BASE64_LEN((n) * 2) + 64)
+
+size_t base64_encode_fast(char *out, const uint8_t *in, size_t len);
+size_t afast_write(char *out, size_t cap, const uint16_t samps[], int n);
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "backlog.h"
+
+#define TAG "BACKLOG"
+
+#ifndef CONFIG_BACKLOG_FLUSH_SPEEDUP
+#define CONFIG_BACKLOG_FLUSH_SPEEDUP 4
+#endif
+
+/* Blocks are stored back to back in a ring of 16 bit words, each prefixed
+ * by a header of HDR_WORDS words: the sample count and the 64 bit capture
+ * time. A full ring evicts whole blocks from the head, so it always holds
+ * the most recent capacity's worth of audio. */
+#define HDR_WORDS 5
+
+typedef enum {
+    MODE_LIVE,
+    MODE_OFFLINE,
+    MODE_DRAINING,
+} backlog_mode_t;
+
+// Guards the ring and stats. A mutex rather than a critical section, since
+// pushing and popping copy whole blocks.
+static SemaphoreHandle_t bl_lock;
+static packetizer_emit_t emit_cb;
+static backlog_ready_t ready_cb;
+static backlog_policy_t policy;
+static volatile backlog_mode_t mode = MODE_LIVE;
+static TaskHandle_t flush_task;
+
+static uint16_t *ring;
+static uint32_t ring_cap, head, used;
+static uint32_t samples_held;
+static backlog_stats_t stats;
+
+static void ring_write(const uint16_t *src, uint32_t n)
+{
+    uint32_t tail = (head + used) % ring_cap;
+    uint32_t first = n < ring_cap - tail ? n : ring_cap - tail;
+
+    memcpy(&ring[tail], src, first * sizeof(uint16_t));
+    memcpy(ring, src + first, (n - first) * sizeof(uint16_t));
+    used += n;
+}
+
+static void ring_read(uint16_t *dst, uint32_t n)
+{
+    uint32_t first = n < ring_cap - head ? n : ring_cap - head;
+
+    if (dst) {
+        memcpy(dst, &ring[head], first * sizeof(uint16_t));
+        memcpy(dst + first, ring, (n - first) * sizeof(uint16_t));
+    }
+    head = (head + n) % ring_cap;
+    used -= n;
+}
+
+// Pops the oldest block into samps, or just drops it if samps is NULL.
+static int ring_pop(uint16_t *samps, int64_t *capture_us)
+{
+    uint16_t hdr[HDR_WORDS];
+    uint64_t t;
+
+    if (!used) return 0;
+    ring_read(hdr, HDR_WORDS);
+    ring_read(samps, hdr[0]);
+    samples_held -= hdr[0];
+    t = (uint64_t)hdr[1] | (uint64_t)hdr[2] << 16 | (uint64_t)hdr[3] << 32 | (uint64_t)hdr[4] << 48;
+    if (capture_us) *capture_us = (int64_t)t;
+    return hdr[0];
+}
+
+static void ring_push(const uint16_t *samps, int n, int64_t capture_us)
+{
+    uint64_t t = (uint64_t)capture_us;
+    uint16_t hdr[HDR_WORDS] = { n, t, t >> 16, t >> 32, t >> 48 };
+
+    while (ring_cap - used < n + HDR_WORDS) {
+        ring_pop(NULL, NULL);
+        stats.evicted++;
+    }
+    ring_write(hdr, HDR_WORDS);
+    ring_write(samps, n);
+    samples_held += n;
+    stats.stored++;
+    if (samples_held > stats.high_water) stats.high_water = samples_held;
+}
+
+// Replays the backlog at up to CONFIG_BACKLOG_FLUSH_SPEEDUP times real time
+// while new blocks keep queueing behind it, then hands over to live sending.
+// Each block waits for room in the transport: a drop-oldest queue fed faster
+// than it drains would throw most of the replay away.
+static void backlog_flush_task(void *pvParameters)
+{
+    static uint16_t samps[PACKETIZER_MAX_FRAMES];
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        int64_t start = esp_timer_get_time();
+        uint64_t replayed = 0;
+        uint32_t blocks = 0, waits = 0;
+
+        while (mode == MODE_DRAINING) {
+            int64_t capture_us;
+            int n;
+
+            if (ready_cb && !ready_cb()) {
+                vTaskDelay(1);
+                waits++;
+                continue;
+            }
+            xSemaphoreTake(bl_lock, portMAX_DELAY);
+            n = ring_pop(samps, &capture_us);
+            if (!n) mode = MODE_LIVE;
+            else stats.flushed++;
+            xSemaphoreGive(bl_lock);
+            if (!n) break;
+
+            emit_cb(samps, n, capture_us);
+            blocks++;
+            replayed += n;
+            int64_t due = start + (int64_t)(replayed * 1000000 / packetizer_rate() / CONFIG_BACKLOG_FLUSH_SPEEDUP);
+            if (due - esp_timer_get_time() >= 1000000 / configTICK_RATE_HZ) vTaskDelay(1);
+        }
+        ESP_LOGI(TAG, "Replayed %" PRIu32 " blocks in %" PRIu32 " ms, %" PRIu32 " ticks waiting for the transport",
+                 blocks, (uint32_t)((esp_timer_get_time() - start) / 1000), waits);
+    }
+}
+
+void backlog_init(packetizer_emit_t emit, backlog_ready_t ready, int capacity_samples, backlog_policy_t pol)
+{
+    emit_cb = emit;
+    ready_cb = ready;
+    policy = pol;
+    bl_lock = xSemaphoreCreateMutex();
+    ring_cap = capacity_samples + (capacity_samples / PACKETIZER_MIN_FRAMES + 1) * HDR_WORDS;
+    ring = malloc(ring_cap * sizeof(uint16_t));
+    if (!ring || !bl_lock) {
+        ESP_LOGE(TAG, "No memory for a %" PRIu32 " sample backlog", (uint32_t)capacity_samples);
+        ring_cap = 0;
+        return;
+    }
+    xTaskCreatePinnedToCore(backlog_flush_task, "backlog", 3072, NULL, 2, &flush_task, 1);
+}
+
+void backlog_emit(uint16_t samps[], int n, int64_t capture_us)
+{
+    if (mode == MODE_LIVE || !ring_cap) {
+        emit_cb(samps, n, capture_us);
+        return;
+    }
+    xSemaphoreTake(bl_lock, portMAX_DELAY);
+    // The flusher may have gone live since the unlocked check.
+    if (mode != MODE_LIVE) {
+        ring_push(samps, n, capture_us);
+        n = 0;
+    }
+    xSemaphoreGive(bl_lock);
+    if (n) emit_cb(samps, n, capture_us);
+}
+
+void backlog_set_online(int online)
+{
+    int drain = 0;
+
+    if (!bl_lock) return;
+    xSemaphoreTake(bl_lock, portMAX_DELAY);
+    if (!online) {
+        mode = MODE_OFFLINE;
+    }
+    else if (mode == MODE_OFFLINE) {
+        if (policy == BACKLOG_FLUSH && used) {
+            mode = MODE_DRAINING;
+            drain = 1;
+        }
+        else {
+            while (ring_pop(NULL, NULL)) stats.skipped++;
+            mode = MODE_LIVE;
+        }
+    }
+    xSemaphoreGive(bl_lock);
+
+    if (drain) xTaskNotifyGive(flush_task);
+}
+
+void backlog_get_stats(backlog_stats_t *out, int reset)
+{
+    if (!bl_lock) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    xSemaphoreTake(bl_lock, portMAX_DELAY);
+    *out = stats;
+    if (reset) memset(&stats, 0, sizeof(stats));
+    xSemaphoreGive(bl_lock);
+}
@@ -0,0 +1,25 @@
+#include <stdint.h>
+#include "packetizer.h"
+
+typedef enum {
+    BACKLOG_FLUSH,  // Replay the backlog faster than real time, then go live.
+    BACKLOG_LIVE,   // Discard the backlog and go live right away.
+} backlog_policy_t;
+
+typedef struct {
+    uint32_t stored;        // Blocks kept while the transport was down.
+    uint32_t evicted;       // Oldest blocks overwritten by a full ring.
+    uint32_t flushed;       // Blocks replayed after a reconnect.
+    uint32_t skipped;       // Blocks discarded by the live policy.
+    uint32_t high_water;    // Most samples held at once.
+} backlog_stats_t;
+
+// Whether the transport has room for another block right now.
+typedef int (*backlog_ready_t)(void);
+
+// ready may be NULL; the replay is then only limited by the speedup.
+void backlog_init(packetizer_emit_t emit, backlog_ready_t ready, int capacity_samples, backlog_policy_t policy);
+// Packetizer emit callback: passes blocks through or keeps them while offline.
+void backlog_emit(uint16_t samps[], int n, int64_t capture_us);
+void backlog_set_online(int online);
+void backlog_get_stats(backlog_stats_t *stats, int reset);
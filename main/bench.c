@@ -0,0 +1,697 @@
+#include <inttypes.h>
+#include <math.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "bench.h"
+#include "packetizer.h"
+#include "udpclient.h"
+
+#if CONFIG_BENCH_AFAST_WRITER
+#include <string.h>
+#include "esp_cpu.h"
+#include "mbedtls/base64.h"
+#include "cJSON.h"
+#include "afast_writer.h"
+#endif
+
+#if CONFIG_BENCH_CJSON
+#include <string.h>
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "cJSON.h"
+#endif
+
+#if CONFIG_BENCH_CJSON_NUMBERS
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_cpu.h"
+#include "esp_random.h"
+#include "cJSON.h"
+#endif
+
+#if CONFIG_BENCH_CJSON_INDEX
+#include <stdio.h>
+#include <string.h>
+#include "esp_cpu.h"
+#include "esp_random.h"
+#include "esp_heap_caps.h"
+#include "cJSON.h"
+#endif
+
+#if CONFIG_BENCH_DSCP
+#include <string.h>
+#include "lwip/sockets.h"
+#include "adapt.h"
+#endif
+
+#if CONFIG_BENCH_UDP_BACKEND || CONFIG_BENCH_DSCP
+#include "conn.h"
+#endif
+
+#define TAG "BENCH"
+
+/* UDP + IPv4 + 802.11 data header + LLC/SNAP + FCS carried by every datagram. */
+#define DATAGRAM_OVERHEAD_BYTES (8 + 20 + 24 + 8 + 4)
+
+#if CONFIG_BENCH_PACKET_SIZE
+static void bench_packet_size_task(void *pvParameters)
+{
+    static const int sizes[] = {64, 128, 256, 500};
+    packetizer_stats_t st;
+
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        packetizer_set_config(sizes[i], sizes[i]);
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        packetizer_get_stats(&st, 1);
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_BENCH_PACKET_SIZE_SECONDS * 1000));
+        packetizer_get_stats(&st, 1);
+
+        if (!st.datagrams) {
+            ESP_LOGW(TAG, "%d samples: no datagrams sent", sizes[i]);
+            continue;
+        }
+        uint32_t payload = sizes[i] * 2;
+        ESP_LOGI(TAG, "%3d samples: %4.1f pkt/s, latency avg %" PRIu32 " max %" PRIu32 " us, "
+                 "hand-off avg %" PRIu32 " max %" PRIu32 " us, overhead %.1f%%",
+                 sizes[i], (float)st.datagrams / CONFIG_BENCH_PACKET_SIZE_SECONDS,
+                 (uint32_t)(st.latency_sum_us / st.datagrams), st.latency_max_us,
+                 (uint32_t)(st.emit_sum_us / st.datagrams), st.emit_max_us,
+                 100.0f * DATAGRAM_OVERHEAD_BYTES / (payload + DATAGRAM_OVERHEAD_BYTES));
+    }
+    packetizer_set_profile(STREAM_PROFILE_BALANCED);
+    vTaskDelete(NULL);
+}
+#endif
+
+#if CONFIG_BENCH_AFAST_WRITER || CONFIG_BENCH_CJSON
+/* cJSON's heap use is counted in a separate pass inside an arena, which only
+ * applies to the calling task, rather than by swapping the global hooks under
+ * the other tasks. Frees in an arena only return the most recent block, so
+ * its high water is an upper bound on the heap peak. */
+static void count_begin(cJSON_Arena *arena, void *mem, size_t size)
+{
+    cJSON_ArenaInit(arena, mem, size);
+    cJSON_ArenaBegin(arena);
+}
+
+static void count_end(cJSON_Arena *arena)
+{
+    cJSON_ArenaEnd(arena);
+    if (arena->failures) ESP_LOGE(TAG, "Counting arena too small, counts are low");
+}
+#endif
+
+#if CONFIG_BENCH_AFAST_WRITER
+#define AFAST_BENCH_SAMPLES 500
+#define AFAST_BENCH_ROUNDS 200
+
+// The cJSON + mbedtls path that send_ledfx_data used before the streaming writer.
+static size_t afast_legacy(const uint16_t samps[], int n)
+{
+    cJSON *root = cJSON_CreateObject();
+    char *json = NULL;
+    size_t len;
+
+    unsigned char inBuf[AFAST_BENCH_SAMPLES*2];
+    unsigned char outBuf[AFAST_BENCH_SAMPLES*3];
+    size_t outlen = AFAST_BENCH_SAMPLES*3;
+
+    for (int i = 0; i < n; i++) {
+        memcpy(inBuf+i*2, (char*)&samps[i], 2);
+    }
+    mbedtls_base64_encode(outBuf, AFAST_BENCH_SAMPLES*3, &outlen, inBuf, n*2);
+
+    cJSON_AddStringToObject(root, "data", (const char*)outBuf);
+    cJSON_AddNumberToObject(root, "id", 1);
+    cJSON_AddStringToObject(root, "client", "ESP32");
+    cJSON_AddStringToObject(root, "type", "afast");
+    json = cJSON_Print(root);
+    len = strlen(json);
+    cJSON_free(json);
+    cJSON_Delete(root);
+    return len;
+}
+
+static void bench_afast_task(void *pvParameters)
+{
+    static uint16_t samps[AFAST_BENCH_SAMPLES];
+    static char out[AFAST_MSG_LEN(AFAST_BENCH_SAMPLES)];
+    static unsigned char ref[AFAST_MSG_LEN(AFAST_BENCH_SAMPLES)];
+    static uint8_t count_mem[4 * AFAST_MSG_LEN(AFAST_BENCH_SAMPLES)];
+    cJSON_Arena counting;
+    size_t legacy_len = 0, fast_len = 0, ref_len = 0;
+    uint32_t start, legacy_cycles, fast_cycles;
+
+    for (int i = 0; i < AFAST_BENCH_SAMPLES; i++)
+        samps[i] = 2048 + (int)(1500.0f * sinf(i * 0.05f));
+
+    // Sanity check the fast encoder against mbedtls before timing anything.
+    mbedtls_base64_encode(ref, sizeof(ref), &ref_len, (const unsigned char *)samps, sizeof(samps));
+    if (base64_encode_fast(out, (const uint8_t *)samps, sizeof(samps)) != ref_len
+        || memcmp(out, ref, ref_len)) {
+        ESP_LOGE(TAG, "afast: base64 output differs from mbedtls");
+    }
+
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < AFAST_BENCH_ROUNDS; i++)
+        legacy_len = afast_legacy(samps, AFAST_BENCH_SAMPLES);
+    legacy_cycles = (esp_cpu_get_cycle_count() - start) / AFAST_BENCH_ROUNDS;
+
+    count_begin(&counting, count_mem, sizeof(count_mem));
+    afast_legacy(samps, AFAST_BENCH_SAMPLES);
+    count_end(&counting);
+
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < AFAST_BENCH_ROUNDS; i++)
+        fast_len = afast_write(out, sizeof(out), samps, AFAST_BENCH_SAMPLES);
+    fast_cycles = (esp_cpu_get_cycle_count() - start) / AFAST_BENCH_ROUNDS;
+
+    ESP_LOGI(TAG, "afast %d samples: cJSON %u bytes %" PRIu32 " cycles heap peak %u stack bufs %u, "
+             "streaming %u bytes %" PRIu32 " cycles heap peak 0 stack bufs 0",
+             AFAST_BENCH_SAMPLES, (unsigned)legacy_len, legacy_cycles, (unsigned)counting.high_water,
+             AFAST_BENCH_SAMPLES * 5, (unsigned)fast_len, fast_cycles);
+    vTaskDelete(NULL);
+}
+#endif
+
+#if CONFIG_BENCH_CJSON
+#define CJSON_BENCH_ROUNDS 400
+#define CJSON_BENCH_ARENA 4096
+// Something else allocates on the heap, and keeps it, every this many messages.
+#define CJSON_BENCH_KEEP_EVERY 8
+
+static const char cjson_bench_msg[] =
+    "{\"type\":\"audio_stream_config\",\"id\":12,\"data\":{\"sampleRate\":15000,"
+    "\"bufferSize\":500,\"blockSize\":500,\"codec\":\"udp\",\"port\":7777}}";
+
+static float heap_fragmentation(void)
+{
+    size_t total = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    return total ? 100.0f * (1.0f - (float)largest / total) : 0.0f;
+}
+
+typedef struct {
+    cJSON *msg, *root;
+    char *json;
+    size_t len;
+    size_t print_allocs;    // Only with a counting arena.
+    uint32_t parse_cycles, print_cycles;
+} cjson_exchange_t;
+
+// Parses a request and prints the reply, like a stream config exchange.
+// into prints into a reused buffer, as json_send() does into a send slot.
+static void bench_cjson_exchange(cjson_exchange_t *x, int into, const cJSON_Arena *counting)
+{
+    static char out[512];
+    uint32_t start = esp_cpu_get_cycle_count();
+
+    x->msg = cJSON_Parse(cjson_bench_msg);
+    x->parse_cycles += esp_cpu_get_cycle_count() - start;
+
+    start = esp_cpu_get_cycle_count();
+    x->root = cJSON_CreateObject();
+    cJSON_AddItemToObject(x->root, "data", cJSON_Duplicate(cJSON_GetObjectItem(x->msg, "data"), 1));
+    cJSON_AddNumberToObject(x->root, "ack", cJSON_GetObjectItem(x->msg, "id")->valuedouble);
+    cJSON_AddStringToObject(x->root, "client", "ESP32");
+    cJSON_AddStringToObject(x->root, "type", "audio_stream_config");
+    x->json = NULL;
+    size_t allocs = counting ? counting->allocations : 0;
+    if (into) x->len = cJSON_PrintInto(x->root, out, sizeof(out), 0);
+    else x->json = cJSON_PrintUnformatted(x->root);
+    x->print_cycles += esp_cpu_get_cycle_count() - start;
+    if (counting) x->print_allocs = counting->allocations - allocs;
+    if (x->json) x->len = strlen(x->json);
+}
+
+static void bench_cjson_release(cjson_exchange_t *x)
+{
+    cJSON_free(x->json);
+    cJSON_Delete(x->root);
+    cJSON_Delete(x->msg);
+}
+
+static void bench_cjson_run(const char *name, cJSON_Arena *arena, int into)
+{
+    static void *keep[CJSON_BENCH_ROUNDS / CJSON_BENCH_KEEP_EVERY];
+    static uint8_t count_mem[CJSON_BENCH_ARENA];
+    cjson_exchange_t x = { 0 };
+    cJSON_Arena counting;
+    size_t allocs = 0, print_allocs = 0, peak = 0;
+    float frag_before = heap_fragmentation(), frag_after;
+
+    for (int i = 0; i < CJSON_BENCH_ROUNDS; i++) {
+        if (arena) cJSON_ArenaBegin(arena);
+        bench_cjson_exchange(&x, into, NULL);
+        if (arena) {
+            cJSON_ArenaEnd(arena);
+            cJSON_ArenaReset(arena);
+        }
+        else bench_cjson_release(&x);
+        if (i % CJSON_BENCH_KEEP_EVERY == 0) keep[i / CJSON_BENCH_KEEP_EVERY] = malloc(24 + i % 40);
+    }
+    frag_after = heap_fragmentation();
+    for (int i = 0; i < CJSON_BENCH_ROUNDS / CJSON_BENCH_KEEP_EVERY; i++) free(keep[i]);
+
+    // An arena run doesn't touch the heap; otherwise count one more exchange.
+    if (!arena) {
+        cjson_exchange_t c = { 0 };
+
+        count_begin(&counting, count_mem, sizeof(count_mem));
+        bench_cjson_exchange(&c, into, &counting);
+        bench_cjson_release(&c);
+        count_end(&counting);
+        allocs = counting.allocations;
+        print_allocs = c.print_allocs;
+        peak = counting.high_water;
+    }
+
+    ESP_LOGI(TAG, "cJSON %-10s: parse %" PRIu32 " cycles, build+print %" PRIu32 " cycles, %u bytes, "
+             "%u heap allocs/msg (%u printing), heap peak %u, fragmentation %.1f%% -> %.1f%%",
+             name, x.parse_cycles / CJSON_BENCH_ROUNDS, x.print_cycles / CJSON_BENCH_ROUNDS, (unsigned)x.len,
+             (unsigned)allocs, (unsigned)print_allocs, (unsigned)peak, frag_before, frag_after);
+}
+
+static void bench_cjson_task(void *pvParameters)
+{
+    static uint8_t mem[CJSON_BENCH_ARENA];
+    cJSON_Arena arena;
+
+    cJSON_ArenaInit(&arena, mem, sizeof(mem));
+    bench_cjson_run("heap", NULL, 0);
+    bench_cjson_run("heap+into", NULL, 1);
+    bench_cjson_run("arena+into", &arena, 1);
+    ESP_LOGI(TAG, "cJSON arena: %u of %u bytes used, %u failed allocations",
+             (unsigned)arena.high_water, (unsigned)arena.size, (unsigned)arena.failures);
+    vTaskDelete(NULL);
+}
+#endif
+
+#if CONFIG_BENCH_CJSON_NUMBERS
+#define NUMBERS_BENCH_VALUES 2000
+
+// print_number as it was before the Grisu2 formatter: %1.15g, read back, %1.17g.
+static int print_number_legacy(double d, char *out)
+{
+    int valueint = d >= INT_MAX ? INT_MAX : d <= (double)INT_MIN ? INT_MIN : (int)d;
+    double test = 0.0;
+    int len;
+
+    if (isnan(d) || isinf(d)) return sprintf(out, "null");
+    if (d == (double)valueint) return sprintf(out, "%d", valueint);
+    len = sprintf(out, "%1.15g", d);
+    if (sscanf(out, "%lg", &test) != 1 || test != d) len = sprintf(out, "%1.17g", d);
+    return len;
+}
+
+static double numbers_bench_value(int i)
+{
+    uint64_t bits;
+    double d;
+
+    switch (i % 4) {
+    case 0:     // Counters and sample values.
+        return (double)(esp_random() % 100000);
+    case 1:     // Sensor style readings with a few decimals.
+        return (double)((int32_t)esp_random() % 1000000) / 1000.0;
+    case 2:     // Single precision values widened, like the DSP's floats.
+        return (double)((float)esp_random() / 4294967296.0f);
+    default:    // Anything at all.
+        do {
+            bits = ((uint64_t)esp_random() << 32) | esp_random();
+            memcpy(&d, &bits, sizeof(d));
+        } while (isnan(d) || isinf(d));
+        return d;
+    }
+}
+
+static void bench_numbers_print(void)
+{
+    static double values[NUMBERS_BENCH_VALUES];
+    char out[32], ref[32];
+    cJSON *item = cJSON_CreateNumber(0);
+    uint32_t start, legacy_cycles = 0, cycles = 0;
+    uint32_t legacy_bytes = 0, bytes = 0, mismatches = 0;
+
+    for (int i = 0; i < NUMBERS_BENCH_VALUES; i++) values[i] = numbers_bench_value(i);
+
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < NUMBERS_BENCH_VALUES; i++) legacy_bytes += print_number_legacy(values[i], ref);
+    legacy_cycles = esp_cpu_get_cycle_count() - start;
+
+    start = esp_cpu_get_cycle_count();
+    for (int i = 0; i < NUMBERS_BENCH_VALUES; i++) {
+        cJSON_SetNumberValue(item, values[i]);
+        bytes += cJSON_PrintInto(item, out, sizeof(out), 0);
+    }
+    cycles = esp_cpu_get_cycle_count() - start;
+
+    // Every value has to read back bit for bit; timed separately.
+    for (int i = 0; i < NUMBERS_BENCH_VALUES; i++) {
+        cJSON_SetNumberValue(item, values[i]);
+        cJSON_PrintInto(item, out, sizeof(out), 0);
+        if (strtod(out, NULL) != values[i]) {
+            if (!mismatches) ESP_LOGE(TAG, "numbers: %.17g printed as %s", values[i], out);
+            mismatches++;
+        }
+    }
+    cJSON_Delete(item);
+
+    ESP_LOGI(TAG, "numbers %d values: sprintf %" PRIu32 " cycles/value %.1f bytes/value, "
+             "grisu2 %" PRIu32 " cycles/value %.1f bytes/value, %" PRIu32 " did not round-trip",
+             NUMBERS_BENCH_VALUES, legacy_cycles / NUMBERS_BENCH_VALUES, (float)legacy_bytes / NUMBERS_BENCH_VALUES,
+             cycles / NUMBERS_BENCH_VALUES, (float)bytes / NUMBERS_BENCH_VALUES, mismatches);
+}
+
+// Number heavy documents: a block of raw samples, a telemetry frame and
+// spectrum style decimals.
+static int numbers_corpus(int kind, char *out, size_t size)
+{
+    int len = 0;
+
+    switch (kind) {
+    case 0:
+        len += snprintf(out + len, size - len, "{\"type\":\"samples\",\"data\":[");
+        for (int i = 0; i < 500; i++)
+            len += snprintf(out + len, size - len, "%s%d", i ? "," : "", 2048 + (int)(1500.0f * sinf(i * 0.05f)));
+        break;
+    case 1:
+        len += snprintf(out + len, size - len, "{\"type\":\"telemetry\",\"seq\":4211,\"d\":[");
+        for (int i = 0; i < 34; i++)
+            len += snprintf(out + len, size - len, "%s%" PRId32, i ? "," : "", (int32_t)(esp_random() >> (i % 31)) - 40000);
+        break;
+    default:
+        len += snprintf(out + len, size - len, "{\"type\":\"spectrum\",\"data\":[");
+        for (int i = 0; i < 200; i++)
+            len += snprintf(out + len, size - len, i % 10 ? "%s%.5g" : "%s%.3e", i ? "," : "",
+                            (double)esp_random() / 4294967296.0 / (1 + i));
+        break;
+    }
+    len += snprintf(out + len, size - len, "]}");
+    return len;
+}
+
+// What parse_number did per number before: copy the token, then strtod.
+static double parse_number_legacy(const char **p)
+{
+    char buf[64];
+    size_t i = 0;
+    char *end;
+    double d;
+
+    while (i < sizeof(buf) - 1 && strchr("0123456789+-eE.", (*p)[i]) && (*p)[i]) {
+        buf[i] = (*p)[i];
+        i++;
+    }
+    buf[i] = '\0';
+    d = strtod(buf, &end);
+    *p += end - buf;
+    return d;
+}
+
+static void bench_numbers_parse(void)
+{
+    static const char *names[] = {"samples", "telemetry", "spectrum"};
+    static char doc[4096];
+    const int rounds = 50;
+
+    for (int kind = 0; kind < 3; kind++) {
+        uint32_t start, cycles, legacy_cycles = 0, mismatches = 0;
+        int count = 0;
+        cJSON *root = NULL;
+
+        numbers_corpus(kind, doc, sizeof(doc));
+        start = esp_cpu_get_cycle_count();
+        for (int r = 0; r < rounds; r++) {
+            cJSON_Delete(root);
+            root = cJSON_Parse(doc);
+        }
+        cycles = (esp_cpu_get_cycle_count() - start) / rounds;
+
+        // The old conversions alone, over the same tokens, checked against the new ones.
+        cJSON *item = cJSON_GetArrayItem(root, kind == 1 ? 2 : 1)->child;
+        const char *p = strchr(doc, '[') + 1;
+        for (; item; item = item->next, p++) {
+            double d;
+
+            start = esp_cpu_get_cycle_count();
+            d = parse_number_legacy(&p);
+            legacy_cycles += esp_cpu_get_cycle_count() - start;
+            if (d != item->valuedouble) mismatches++;
+            count++;
+        }
+        cJSON_Delete(root);
+
+        ESP_LOGI(TAG, "numbers parse %-9s: %d numbers, whole parse %" PRIu32 " cycles/number, "
+                 "old conversion alone %" PRIu32 " cycles/number, %" PRIu32 " differ from strtod",
+                 names[kind], count, cycles / count, legacy_cycles / count, mismatches);
+    }
+}
+
+static void bench_cjson_numbers_task(void *pvParameters)
+{
+    bench_numbers_print();
+    bench_numbers_parse();
+    vTaskDelete(NULL);
+}
+#endif
+
+#if CONFIG_BENCH_CJSON_INDEX
+#define INDEX_BENCH_LOOKUPS 512
+#define INDEX_BENCH_PASSES 4
+
+// get_object_item's case sensitive walk as it was before the index.
+static cJSON *index_bench_linear(const cJSON *object, const char *name)
+{
+    cJSON *c = object->child;
+
+    while (c && c->string && strcmp(name, c->string)) c = c->next;
+    return c && c->string ? c : NULL;
+}
+
+static uint32_t index_bench_time(const cJSON *object, char keys[][16], int mode, int *misses)
+{
+    uint64_t total = 0;
+
+    for (int pass = 0; pass < INDEX_BENCH_PASSES; pass++) {
+        uint32_t start = esp_cpu_get_cycle_count();
+        for (int i = 0; i < INDEX_BENCH_LOOKUPS; i++) {
+            cJSON *found = mode == 0 ? index_bench_linear(object, keys[i])
+                         : mode == 1 ? cJSON_GetObjectItemCaseSensitive(object, keys[i])
+                         : cJSON_GetObjectItem(object, keys[i]);
+            if (!found) (*misses)++;
+        }
+        total += esp_cpu_get_cycle_count() - start;
+    }
+    return (uint32_t)(total / (INDEX_BENCH_PASSES * INDEX_BENCH_LOOKUPS));
+}
+
+static void bench_cjson_index_task(void *pvParameters)
+{
+    static const int sizes[] = {4, 16, 64, 256, 1024, 4096, 10000};
+    static char keys[INDEX_BENCH_LOOKUPS][16];
+    char name[16];
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        int members = sizes[s], misses = 0;
+        cJSON *object = cJSON_CreateObject();
+        uint32_t linear, sensitive, insensitive, build;
+        size_t heap_before, heap_after;
+
+        for (int i = 0; object && i < members; i++) {
+            snprintf(name, sizeof(name), "setting_%d", i);
+            if (!cJSON_AddNumberToObject(object, name, i)) {
+                ESP_LOGW(TAG, "index: out of memory at %d of %d members", i, members);
+                cJSON_Delete(object);
+                object = NULL;
+            }
+        }
+        if (!object) break;
+        for (int i = 0; i < INDEX_BENCH_LOOKUPS; i++)
+            snprintf(keys[i], sizeof(keys[i]), "setting_%" PRIu32, esp_random() % members);
+
+        linear = index_bench_time(object, keys, 0, &misses);
+
+        // The first lookup that walks far enough builds the index.
+        snprintf(name, sizeof(name), "setting_%d", members - 1);
+        heap_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        uint32_t start = esp_cpu_get_cycle_count();
+        cJSON_GetObjectItemCaseSensitive(object, name);
+        build = esp_cpu_get_cycle_count() - start;
+        heap_after = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+        sensitive = index_bench_time(object, keys, 1, &misses);
+
+        cJSON_GetObjectItem(object, name);
+        insensitive = index_bench_time(object, keys, 2, &misses);
+
+        ESP_LOGI(TAG, "index %5d members: linear %" PRIu32 " cycles/lookup, indexed %" PRIu32
+                 " (case insensitive %" PRIu32 "), first lookup %" PRIu32 " cycles, index %d bytes%s",
+                 members, linear, sensitive, insensitive, build, (int)(heap_before - heap_after),
+                 misses ? ", MISSES" : "");
+        cJSON_Delete(object);
+    }
+    vTaskDelete(NULL);
+}
+#endif
+
+#if CONFIG_BENCH_UDP_BACKEND || CONFIG_BENCH_DSCP
+// The benches start from app_main; there is nothing to measure, nor a
+// destination, until the handshake has started the UDP stream.
+static void bench_wait_streaming(udp_dest_stats_t *dest)
+{
+    while (conn_get_state() != CONN_STREAMING || udp_get_dest_stats(dest, 1) < 1)
+        vTaskDelay(pdMS_TO_TICKS(500));
+}
+#endif
+
+#if CONFIG_BENCH_UDP_BACKEND
+static void bench_udp_backend_task(void *pvParameters)
+{
+    static const char *names[] = {"socket", "raw", "inline"};
+    udp_tx_stats_t st;
+    udp_dest_stats_t dest;
+
+    bench_wait_streaming(&dest);
+    for (int b = UDP_BACKEND_SOCKET; b <= UDP_BACKEND_INLINE; b++) {
+        udp_set_backend(b);
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        udp_get_tx_stats(&st, 1);
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_BENCH_UDP_BACKEND_SECONDS * 1000));
+        udp_get_tx_stats(&st, 1);
+
+        if (!st.sent || !st.gaps) {
+            ESP_LOGW(TAG, "%s backend: nothing sent", names[b]);
+            continue;
+        }
+        float mean = (float)st.gap_sum_us / st.gaps;
+        float var = (float)st.gap_sq_sum / st.gaps - mean * mean;
+        ESP_LOGI(TAG, "%s backend: %" PRIu32 " sent %" PRIu32 " err %" PRIu32 " dropped, "
+                 "cpu avg %" PRIu32 " max %" PRIu32 " us/pkt, latency avg %" PRIu32 " max %" PRIu32 " us, "
+                 "interval %.0f us jitter %.0f us",
+                 names[b], st.sent, st.errors, st.dropped,
+                 (uint32_t)(st.cpu_sum_us / st.sent), st.cpu_max_us,
+                 (uint32_t)(st.lat_sum_us / st.sent), st.lat_max_us,
+                 mean, var > 0 ? sqrtf(var) : 0.0f);
+    }
+#if CONFIG_UDP_BACKEND_RAW
+    udp_set_backend(UDP_BACKEND_RAW);
+#elif CONFIG_UDP_BACKEND_INLINE
+    udp_set_backend(UDP_BACKEND_INLINE);
+#else
+    udp_set_backend(UDP_BACKEND_SOCKET);
+#endif
+    vTaskDelete(NULL);
+}
+#endif
+
+#if CONFIG_BENCH_DSCP
+#define LOAD_DATAGRAM_BYTES 1400
+#define LOAD_PORT 9 // discard
+
+static volatile int load_run;
+// First stream destination, filled in before the load task starts.
+static udp_dest_stats_t load_dest;
+
+// Unmarked bulk traffic to the same host, paced per tick.
+static void bench_load_task(void *pvParameters)
+{
+    static char buf[LOAD_DATAGRAM_BYTES];
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(LOAD_PORT) };
+    int per_tick = CONFIG_BENCH_DSCP_LOAD_KBPS * 1000 / 8 / LOAD_DATAGRAM_BYTES / configTICK_RATE_HZ;
+    char ip[24];
+
+    if (per_tick < 1) per_tick = 1;
+    strlcpy(ip, load_dest.addr, sizeof(ip));
+    if (strchr(ip, ':')) *strchr(ip, ':') = 0;
+    inet_aton(ip, &sa.sin_addr);
+
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "load: unable to create socket: errno %d", errno);
+        load_run = 0;
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGI(TAG, "load: %d x %d bytes per tick to %s:%d", per_tick, LOAD_DATAGRAM_BYTES, ip, LOAD_PORT);
+    while (load_run) {
+        for (int i = 0; i < per_tick; i++)
+            sendto(sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&sa, sizeof(sa));
+        vTaskDelay(1);
+    }
+    close(sock);
+    vTaskDelete(NULL);
+}
+
+static void bench_dscp_task(void *pvParameters)
+{
+    static const int phases[] = {0, CONFIG_UDP_DSCP};
+    udp_tx_stats_t st;
+    adapt_stats_t fb;
+
+    bench_wait_streaming(&load_dest);
+    load_run = 1;
+    xTaskCreatePinnedToCore(bench_load_task, "bench_load", 2048, NULL, 1, NULL, 0);
+
+    for (int i = 0; i < 2; i++) {
+        udp_set_dscp(phases[i]);
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        udp_get_tx_stats(&st, 1);
+        adapt_get_stats(&fb);
+        uint32_t reports = fb.reports;
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_BENCH_DSCP_SECONDS * 1000));
+        udp_get_tx_stats(&st, 1);
+        adapt_get_stats(&fb);
+
+        if (!st.gaps) {
+            ESP_LOGW(TAG, "DSCP %d: nothing sent", phases[i]);
+            continue;
+        }
+        float mean = (float)st.gap_sum_us / st.gaps;
+        float var = (float)st.gap_sq_sum / st.gaps - mean * mean;
+        if (fb.reports == reports) {
+            ESP_LOGI(TAG, "DSCP %2d: %" PRIu32 " sent %" PRIu32 " err, send jitter %.0f us, no receiver feedback",
+                     phases[i], st.sent, st.errors, var > 0 ? sqrtf(var) : 0.0f);
+        }
+        else {
+            ESP_LOGI(TAG, "DSCP %2d: %" PRIu32 " sent %" PRIu32 " err, send jitter %.0f us, "
+                     "receiver loss %.2f%% jitter %.2f ms",
+                     phases[i], st.sent, st.errors, var > 0 ? sqrtf(var) : 0.0f,
+                     fb.loss * 100.0f, fb.jitter_ms);
+        }
+    }
+    load_run = 0;
+    udp_set_dscp(CONFIG_UDP_DSCP);
+    vTaskDelete(NULL);
+}
+#endif
+
+void bench_start(void)
+{
+#if CONFIG_BENCH_PACKET_SIZE
+    xTaskCreatePinnedToCore(bench_packet_size_task, "bench_pkt", 3072, NULL, 2, NULL, 1);
+#endif
+#if CONFIG_BENCH_UDP_BACKEND
+    xTaskCreatePinnedToCore(bench_udp_backend_task, "bench_udp", 3072, NULL, 2, NULL, 1);
+#endif
+#if CONFIG_BENCH_DSCP
+    xTaskCreatePinnedToCore(bench_dscp_task, "bench_dscp", 3072, NULL, 2, NULL, 1);
+#endif
+#if CONFIG_BENCH_CJSON
+    xTaskCreatePinnedToCore(bench_cjson_task, "bench_cjson", 4096, NULL, 2, NULL, 1);
+#endif
+#if CONFIG_BENCH_CJSON_NUMBERS
+    xTaskCreatePinnedToCore(bench_cjson_numbers_task, "bench_num", 4096, NULL, 2, NULL, 1);
+#endif
+#if CONFIG_BENCH_CJSON_INDEX
+    xTaskCreatePinnedToCore(bench_cjson_index_task, "bench_index", 4096, NULL, 2, NULL, 1);
+#endif
+#if CONFIG_BENCH_AFAST_WRITER
+    xTaskCreatePinnedToCore(bench_afast_task, "bench_afast", 6144, NULL, 2, NULL, 1);
+#endif
+}
@@ -0,0 +1 @@
+void bench_start(void);
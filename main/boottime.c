@@ -0,0 +1,37 @@
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "boottime.h"
+
+#define TAG "BOOT"
+
+static const char *names[BOOT_PHASES] = {
+    "app_main", "wifi start", "associated", "got ip", "websocket", "handshake", "first packet",
+};
+
+static int64_t marks[BOOT_PHASES];
+
+void boot_mark(boot_phase_t phase)
+{
+    int64_t prev = 0;
+
+    if (marks[phase]) return;
+    marks[phase] = esp_timer_get_time();
+    if (phase != BOOT_FIRST_PACKET) return;
+
+    // esp_timer starts with the app's startup code, so ROM and second stage
+    // bootloader time is not included.
+    for (int i = 0; i < BOOT_PHASES; i++) {
+        if (!marks[i]) continue;
+        ESP_LOGI(TAG, "%-12s %6" PRIu32 " ms  (+%" PRIu32 " ms)", names[i],
+                 (uint32_t)(marks[i] / 1000), (uint32_t)((marks[i] - prev) / 1000));
+        prev = marks[i];
+    }
+}
+
+int64_t boot_time(boot_phase_t phase)
+{
+    return marks[phase];
+}
@@ -0,0 +1,19 @@
+#include <stdint.h>
+
+// Boot phases in the order they normally complete.
+typedef enum {
+    BOOT_APP_MAIN,
+    BOOT_WIFI_START,
+    BOOT_WIFI_ASSOC,
+    BOOT_GOT_IP,
+    BOOT_WS_CONNECTED,
+    BOOT_HANDSHAKE,
+    BOOT_FIRST_PACKET,
+    BOOT_PHASES,
+} boot_phase_t;
+
+// Records when a phase was first reached; later calls are ignored.
+// Reaching BOOT_FIRST_PACKET logs the whole timeline.
+void boot_mark(boot_phase_t phase);
+// esp_timer time of a phase, 0 if not reached yet.
+int64_t boot_time(boot_phase_t phase);
@@ -44,6 +44,7 @@
 #include <limits.h>
 #include <ctype.h>
 #include <float.h>
+#include <stdint.h>
 
 #ifdef ENABLE_LOCALES
 #include <locale.h>
@@ -183,7 +184,161 @@ static void * CJSON_CDECL internal_realloc(void *pointer, size_t size)
 /* strlen of character literals resolved at compile time */
 #define static_strlen(string_literal) (sizeof(string_literal) - sizeof(""))
 
-static internal_hooks global_hooks = { internal_malloc, internal_free, internal_realloc };
+#if defined(__GNUC__) || defined(__clang__)
+#define CJSON_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define CJSON_THREAD_LOCAL __declspec(thread)
+#else
+#define CJSON_THREAD_LOCAL
+#endif
+
+#define CJSON_ARENA_ALIGN 8
+
+/* the hooks set with cJSON_InitHooks, used whenever no arena is active */
+static internal_hooks base_hooks = { internal_malloc, internal_free, internal_realloc };
+static CJSON_THREAD_LOCAL cJSON_Arena *current_arena = NULL;
+
+static cJSON_bool arena_owns(const cJSON_Arena * const arena, const void * const pointer)
+{
+    const unsigned char *p = (const unsigned char*)pointer;
+
+    return (arena != NULL) && (p >= arena->memory) && (p < arena->memory + arena->size);
+}
+
+static void *arena_take(cJSON_Arena * const arena, size_t size)
+{
+    size_t start = (arena->used + (CJSON_ARENA_ALIGN - 1)) & ~(size_t)(CJSON_ARENA_ALIGN - 1);
+
+    if ((start > arena->size) || (size > arena->size - start))
+    {
+        arena->failures++;
+        return NULL;
+    }
+
+    arena->last = start;
+    arena->used = start + size;
+    if (arena->used > arena->high_water)
+    {
+        arena->high_water = arena->used;
+    }
+    arena->allocations++;
+
+    return arena->memory + start;
+}
+
+static void * CJSON_CDECL arena_allocate(size_t size)
+{
+    if (current_arena != NULL)
+    {
+        return arena_take(current_arena, size);
+    }
+
+    return base_hooks.allocate(size);
+}
+
+static void CJSON_CDECL arena_deallocate(void *pointer)
+{
+    cJSON_Arena *arena = current_arena;
+
+    if (arena_owns(arena, pointer))
+    {
+        /* giving back the most recent block lets temporaries be reused */
+        if ((unsigned char*)pointer == arena->memory + arena->last)
+        {
+            arena->used = arena->last;
+        }
+        return;
+    }
+
+    base_hooks.deallocate(pointer);
+}
+
+static void * CJSON_CDECL arena_reallocate(void *pointer, size_t size)
+{
+    cJSON_Arena *arena = current_arena;
+    size_t offset = 0;
+    size_t available = 0;
+    unsigned char *copy = NULL;
+
+    if (!arena_owns(arena, pointer))
+    {
+        return base_hooks.reallocate(pointer, size);
+    }
+
+    offset = (size_t)((unsigned char*)pointer - arena->memory);
+    if (offset == arena->last)
+    {
+        /* the print buffer is usually the most recent block, so it grows in place */
+        if (size > arena->size - offset)
+        {
+            arena->failures++;
+            return NULL;
+        }
+        arena->used = offset + size;
+        if (arena->used > arena->high_water)
+        {
+            arena->high_water = arena->used;
+        }
+        return pointer;
+    }
+
+    /* the old size isn't known, but the block ends before arena->used */
+    available = arena->used - offset;
+    copy = (unsigned char*)arena_take(arena, size);
+    if (copy != NULL)
+    {
+        memcpy(copy, pointer, (size < available) ? size : available);
+    }
+
+    return copy;
+}
+
+static internal_hooks global_hooks = { arena_allocate, arena_deallocate, arena_reallocate };
+
+CJSON_PUBLIC(void) cJSON_ArenaInit(cJSON_Arena *arena, void *memory, size_t size)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+
+    memset(arena, 0, sizeof(*arena));
+    arena->memory = (unsigned char*)memory;
+    arena->size = (memory != NULL) ? size : 0;
+}
+
+CJSON_PUBLIC(void) cJSON_ArenaBegin(cJSON_Arena *arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+
+    arena->previous = current_arena;
+    current_arena = arena;
+}
+
+CJSON_PUBLIC(void) cJSON_ArenaEnd(cJSON_Arena *arena)
+{
+    if ((arena == NULL) || (current_arena != arena))
+    {
+        return;
+    }
+
+    current_arena = arena->previous;
+    arena->previous = NULL;
+}
+
+CJSON_PUBLIC(void) cJSON_ArenaReset(cJSON_Arena *arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+
+    arena->used = 0;
+    arena->last = 0;
+}
 
 static unsigned char* cJSON_strdup(const unsigned char* string, const internal_hooks * const hooks)
 {
@@ -208,32 +363,36 @@ static unsigned char* cJSON_strdup(const unsigned char* string, const internal_h
 
 CJSON_PUBLIC(void) cJSON_InitHooks(cJSON_Hooks* hooks)
 {
+    /* global_hooks stay the arena wrappers, which fall back to base_hooks */
     if (hooks == NULL)
     {
         /* Reset hooks */
-        global_hooks.allocate = malloc;
-        global_hooks.deallocate = free;
-        global_hooks.reallocate = realloc;
+        base_hooks.allocate = malloc;
+        base_hooks.deallocate = free;
+        base_hooks.reallocate = realloc;
+        global_hooks.reallocate = arena_reallocate;
         return;
     }
 
-    global_hooks.allocate = malloc;
+    base_hooks.allocate = malloc;
     if (hooks->malloc_fn != NULL)
     {
-        global_hooks.allocate = hooks->malloc_fn;
+        base_hooks.allocate = hooks->malloc_fn;
     }
 
-    global_hooks.deallocate = free;
+    base_hooks.deallocate = free;
     if (hooks->free_fn != NULL)
     {
-        global_hooks.deallocate = hooks->free_fn;
+        base_hooks.deallocate = hooks->free_fn;
     }
 
     /* use realloc only if both free and malloc are used */
+    base_hooks.reallocate = NULL;
     global_hooks.reallocate = NULL;
-    if ((global_hooks.allocate == malloc) && (global_hooks.deallocate == free))
+    if ((base_hooks.allocate == malloc) && (base_hooks.deallocate == free))
     {
-        global_hooks.reallocate = realloc;
+        base_hooks.reallocate = realloc;
+        global_hooks.reallocate = arena_reallocate;
     }
 }
 
@@ -268,6 +427,7 @@ CJSON_PUBLIC(void) cJSON_Delete(cJSON *item)
         {
             global_hooks.deallocate(item->string);
         }
+        cJSON_InvalidateIndex(item);
         global_hooks.deallocate(item);
         item = next;
     }
@@ -301,23 +461,272 @@ typedef struct
 /* get a pointer to the buffer at the position */
 #define buffer_at_offset(buffer) ((buffer)->content + (buffer)->offset)
 
-/* Parse the input text to generate a number, and populate the result into item. */
-static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_buffer)
+/* Number parsing without strtod for the common cases:
+ * - plain integers of up to 19 digits are read exactly into an int64,
+ * - up to 19 significant digits with a small exponent are converted with
+ *   Clinger's exact fast path or the Eisel-Lemire algorithm (as in Go's
+ *   strconv), which is correctly rounded or reports that it can't decide.
+ * Anything else (more digits, huge exponents, undecidable halfway cases) goes
+ * to strtod as before. */
+#define POW10_MIN_EXPONENT (-64)
+#define POW10_MAX_EXPONENT 64
+
+/* 10^q for q = -64..64 as 128-bit mantissas, normalized and rounded down */
+static const uint64_t pow10_u128[][2] =
 {
-    double number = 0;
-    unsigned char *after_end = NULL;
-    unsigned char number_c_string[64];
-    unsigned char decimal_point = get_decimal_point();
-    size_t i = 0;
+    {UINT64_C(0xA87FEA27A539E9A5), UINT64_C(0x3F2398D747B36224)},
+    {UINT64_C(0xD29FE4B18E88640E), UINT64_C(0x8EEC7F0D19A03AAD)},
+    {UINT64_C(0x83A3EEEEF9153E89), UINT64_C(0x1953CF68300424AC)},
+    {UINT64_C(0xA48CEAAAB75A8E2B), UINT64_C(0x5FA8C3423C052DD7)},
+    {UINT64_C(0xCDB02555653131B6), UINT64_C(0x3792F412CB06794D)},
+    {UINT64_C(0x808E17555F3EBF11), UINT64_C(0xE2BBD88BBEE40BD0)},
+    {UINT64_C(0xA0B19D2AB70E6ED6), UINT64_C(0x5B6ACEAEAE9D0EC4)},
+    {UINT64_C(0xC8DE047564D20A8B), UINT64_C(0xF245825A5A445275)},
+    {UINT64_C(0xFB158592BE068D2E), UINT64_C(0xEED6E2F0F0D56712)},
+    {UINT64_C(0x9CED737BB6C4183D), UINT64_C(0x55464DD69685606B)},
+    {UINT64_C(0xC428D05AA4751E4C), UINT64_C(0xAA97E14C3C26B886)},
+    {UINT64_C(0xF53304714D9265DF), UINT64_C(0xD53DD99F4B3066A8)},
+    {UINT64_C(0x993FE2C6D07B7FAB), UINT64_C(0xE546A8038EFE4029)},
+    {UINT64_C(0xBF8FDB78849A5F96), UINT64_C(0xDE98520472BDD033)},
+    {UINT64_C(0xEF73D256A5C0F77C), UINT64_C(0x963E66858F6D4440)},
+    {UINT64_C(0x95A8637627989AAD), UINT64_C(0xDDE7001379A44AA8)},
+    {UINT64_C(0xBB127C53B17EC159), UINT64_C(0x5560C018580D5D52)},
+    {UINT64_C(0xE9D71B689DDE71AF), UINT64_C(0xAAB8F01E6E10B4A6)},
+    {UINT64_C(0x9226712162AB070D), UINT64_C(0xCAB3961304CA70E8)},
+    {UINT64_C(0xB6B00D69BB55C8D1), UINT64_C(0x3D607B97C5FD0D22)},
+    {UINT64_C(0xE45C10C42A2B3B05), UINT64_C(0x8CB89A7DB77C506A)},
+    {UINT64_C(0x8EB98A7A9A5B04E3), UINT64_C(0x77F3608E92ADB242)},
+    {UINT64_C(0xB267ED1940F1C61C), UINT64_C(0x55F038B237591ED3)},
+    {UINT64_C(0xDF01E85F912E37A3), UINT64_C(0x6B6C46DEC52F6688)},
+    {UINT64_C(0x8B61313BBABCE2C6), UINT64_C(0x2323AC4B3B3DA015)},
+    {UINT64_C(0xAE397D8AA96C1B77), UINT64_C(0xABEC975E0A0D081A)},
+    {UINT64_C(0xD9C7DCED53C72255), UINT64_C(0x96E7BD358C904A21)},
+    {UINT64_C(0x881CEA14545C7575), UINT64_C(0x7E50D64177DA2E54)},
+    {UINT64_C(0xAA242499697392D2), UINT64_C(0xDDE50BD1D5D0B9E9)},
+    {UINT64_C(0xD4AD2DBFC3D07787), UINT64_C(0x955E4EC64B44E864)},
+    {UINT64_C(0x84EC3C97DA624AB4), UINT64_C(0xBD5AF13BEF0B113E)},
+    {UINT64_C(0xA6274BBDD0FADD61), UINT64_C(0xECB1AD8AEACDD58E)},
+    {UINT64_C(0xCFB11EAD453994BA), UINT64_C(0x67DE18EDA5814AF2)},
+    {UINT64_C(0x81CEB32C4B43FCF4), UINT64_C(0x80EACF948770CED7)},
+    {UINT64_C(0xA2425FF75E14FC31), UINT64_C(0xA1258379A94D028D)},
+    {UINT64_C(0xCAD2F7F5359A3B3E), UINT64_C(0x096EE45813A04330)},
+    {UINT64_C(0xFD87B5F28300CA0D), UINT64_C(0x8BCA9D6E188853FC)},
+    {UINT64_C(0x9E74D1B791E07E48), UINT64_C(0x775EA264CF55347D)},
+    {UINT64_C(0xC612062576589DDA), UINT64_C(0x95364AFE032A819D)},
+    {UINT64_C(0xF79687AED3EEC551), UINT64_C(0x3A83DDBD83F52204)},
+    {UINT64_C(0x9ABE14CD44753B52), UINT64_C(0xC4926A9672793542)},
+    {UINT64_C(0xC16D9A0095928A27), UINT64_C(0x75B7053C0F178293)},
+    {UINT64_C(0xF1C90080BAF72CB1), UINT64_C(0x5324C68B12DD6338)},
+    {UINT64_C(0x971DA05074DA7BEE), UINT64_C(0xD3F6FC16EBCA5E03)},
+    {UINT64_C(0xBCE5086492111AEA), UINT64_C(0x88F4BB1CA6BCF584)},
+    {UINT64_C(0xEC1E4A7DB69561A5), UINT64_C(0x2B31E9E3D06C32E5)},
+    {UINT64_C(0x9392EE8E921D5D07), UINT64_C(0x3AFF322E62439FCF)},
+    {UINT64_C(0xB877AA3236A4B449), UINT64_C(0x09BEFEB9FAD487C2)},
+    {UINT64_C(0xE69594BEC44DE15B), UINT64_C(0x4C2EBE687989A9B3)},
+    {UINT64_C(0x901D7CF73AB0ACD9), UINT64_C(0x0F9D37014BF60A10)},
+    {UINT64_C(0xB424DC35095CD80F), UINT64_C(0x538484C19EF38C94)},
+    {UINT64_C(0xE12E13424BB40E13), UINT64_C(0x2865A5F206B06FB9)},
+    {UINT64_C(0x8CBCCC096F5088CB), UINT64_C(0xF93F87B7442E45D3)},
+    {UINT64_C(0xAFEBFF0BCB24AAFE), UINT64_C(0xF78F69A51539D748)},
+    {UINT64_C(0xDBE6FECEBDEDD5BE), UINT64_C(0xB573440E5A884D1B)},
+    {UINT64_C(0x89705F4136B4A597), UINT64_C(0x31680A88F8953030)},
+    {UINT64_C(0xABCC77118461CEFC), UINT64_C(0xFDC20D2B36BA7C3D)},
+    {UINT64_C(0xD6BF94D5E57A42BC), UINT64_C(0x3D32907604691B4C)},
+    {UINT64_C(0x8637BD05AF6C69B5), UINT64_C(0xA63F9A49C2C1B10F)},
+    {UINT64_C(0xA7C5AC471B478423), UINT64_C(0x0FCF80DC33721D53)},
+    {UINT64_C(0xD1B71758E219652B), UINT64_C(0xD3C36113404EA4A8)},
+    {UINT64_C(0x83126E978D4FDF3B), UINT64_C(0x645A1CAC083126E9)},
+    {UINT64_C(0xA3D70A3D70A3D70A), UINT64_C(0x3D70A3D70A3D70A3)},
+    {UINT64_C(0xCCCCCCCCCCCCCCCC), UINT64_C(0xCCCCCCCCCCCCCCCC)},
+    {UINT64_C(0x8000000000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xA000000000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xC800000000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xFA00000000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0x9C40000000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xC350000000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xF424000000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0x9896800000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xBEBC200000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xEE6B280000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0x9502F90000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xBA43B74000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xE8D4A51000000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0x9184E72A00000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xB5E620F480000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xE35FA931A0000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0x8E1BC9BF04000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xB1A2BC2EC5000000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xDE0B6B3A76400000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0x8AC7230489E80000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xAD78EBC5AC620000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xD8D726B7177A8000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0x878678326EAC9000), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xA968163F0A57B400), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xD3C21BCECCEDA100), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0x84595161401484A0), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xA56FA5B99019A5C8), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0xCECB8F27F4200F3A), UINT64_C(0x0000000000000000)},
+    {UINT64_C(0x813F3978F8940984), UINT64_C(0x4000000000000000)},
+    {UINT64_C(0xA18F07D736B90BE5), UINT64_C(0x5000000000000000)},
+    {UINT64_C(0xC9F2C9CD04674EDE), UINT64_C(0xA400000000000000)},
+    {UINT64_C(0xFC6F7C4045812296), UINT64_C(0x4D00000000000000)},
+    {UINT64_C(0x9DC5ADA82B70B59D), UINT64_C(0xF020000000000000)},
+    {UINT64_C(0xC5371912364CE305), UINT64_C(0x6C28000000000000)},
+    {UINT64_C(0xF684DF56C3E01BC6), UINT64_C(0xC732000000000000)},
+    {UINT64_C(0x9A130B963A6C115C), UINT64_C(0x3C7F400000000000)},
+    {UINT64_C(0xC097CE7BC90715B3), UINT64_C(0x4B9F100000000000)},
+    {UINT64_C(0xF0BDC21ABB48DB20), UINT64_C(0x1E86D40000000000)},
+    {UINT64_C(0x96769950B50D88F4), UINT64_C(0x1314448000000000)},
+    {UINT64_C(0xBC143FA4E250EB31), UINT64_C(0x17D955A000000000)},
+    {UINT64_C(0xEB194F8E1AE525FD), UINT64_C(0x5DCFAB0800000000)},
+    {UINT64_C(0x92EFD1B8D0CF37BE), UINT64_C(0x5AA1CAE500000000)},
+    {UINT64_C(0xB7ABC627050305AD), UINT64_C(0xF14A3D9E40000000)},
+    {UINT64_C(0xE596B7B0C643C719), UINT64_C(0x6D9CCD05D0000000)},
+    {UINT64_C(0x8F7E32CE7BEA5C6F), UINT64_C(0xE4820023A2000000)},
+    {UINT64_C(0xB35DBF821AE4F38B), UINT64_C(0xDDA2802C8A800000)},
+    {UINT64_C(0xE0352F62A19E306E), UINT64_C(0xD50B2037AD200000)},
+    {UINT64_C(0x8C213D9DA502DE45), UINT64_C(0x4526F422CC340000)},
+    {UINT64_C(0xAF298D050E4395D6), UINT64_C(0x9670B12B7F410000)},
+    {UINT64_C(0xDAF3F04651D47B4C), UINT64_C(0x3C0CDD765F114000)},
+    {UINT64_C(0x88D8762BF324CD0F), UINT64_C(0xA5880A69FB6AC800)},
+    {UINT64_C(0xAB0E93B6EFEE0053), UINT64_C(0x8EEA0D047A457A00)},
+    {UINT64_C(0xD5D238A4ABE98068), UINT64_C(0x72A4904598D6D880)},
+    {UINT64_C(0x85A36366EB71F041), UINT64_C(0x47A6DA2B7F864750)},
+    {UINT64_C(0xA70C3C40A64E6C51), UINT64_C(0x999090B65F67D924)},
+    {UINT64_C(0xD0CF4B50CFE20765), UINT64_C(0xFFF4B4E3F741CF6D)},
+    {UINT64_C(0x82818F1281ED449F), UINT64_C(0xBFF8F10E7A8921A4)},
+    {UINT64_C(0xA321F2D7226895C7), UINT64_C(0xAFF72D52192B6A0D)},
+    {UINT64_C(0xCBEA6F8CEB02BB39), UINT64_C(0x9BF4F8A69F764490)},
+    {UINT64_C(0xFEE50B7025C36A08), UINT64_C(0x02F236D04753D5B4)},
+    {UINT64_C(0x9F4F2726179A2245), UINT64_C(0x01D762422C946590)},
+    {UINT64_C(0xC722F0EF9D80AAD6), UINT64_C(0x424D3AD2B7B97EF5)},
+    {UINT64_C(0xF8EBAD2B84E0D58B), UINT64_C(0xD2E0898765A7DEB2)},
+    {UINT64_C(0x9B934C3B330C8577), UINT64_C(0x63CC55F49F88EB2F)},
+    {UINT64_C(0xC2781F49FFCFA6D5), UINT64_C(0x3CBF6B71C76B25FB)}
+};
+
+static const double exact_pow10[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-    if ((input_buffer == NULL) || (input_buffer->content == NULL))
+static void multiply_u64(const uint64_t a, const uint64_t b, uint64_t * const high, uint64_t * const low)
+{
+    const uint64_t mask32 = UINT64_C(0xFFFFFFFF);
+    uint64_t a_lo = a & mask32;
+    uint64_t a_hi = a >> 32;
+    uint64_t b_lo = b & mask32;
+    uint64_t b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t hi_hi = a_hi * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & mask32) + lo_hi;
+
+    *high = hi_hi + (hi_lo >> 32) + (cross >> 32);
+    *low = (cross << 32) | (lo_lo & mask32);
+}
+
+static int leading_zeros_u64(uint64_t x)
+{
+    int n = 0;
+
+    while ((x & (UINT64_C(1) << 63)) == 0)
+    {
+        x <<= 1;
+        n++;
+    }
+    return n;
+}
+
+/* w * 10^q correctly rounded, w != 0; false if the result can't be decided here */
+static cJSON_bool eisel_lemire(uint64_t w, const int q, const cJSON_bool negative, double * const result)
+{
+    const uint64_t *power = NULL;
+    uint64_t x_hi = 0;
+    uint64_t x_lo = 0;
+    uint64_t mantissa = 0;
+    uint64_t bits = 0;
+    int64_t exponent = 0;
+    int clz = 0;
+    int msb = 0;
+
+    if ((q < POW10_MIN_EXPONENT) || (q > POW10_MAX_EXPONENT))
     {
         return false;
     }
+    power = pow10_u128[q - POW10_MIN_EXPONENT];
+
+    clz = leading_zeros_u64(w);
+    w <<= clz;
+    /* floor(q * log2(10)) + 64 + bias - clz, 217706 / 2^16 ~ log2(10) */
+    exponent = (q >= 0) ? ((217706 * q) >> 16) : -(((-217706 * q) + 65535) >> 16);
+    exponent += 64 + 1023 - clz;
+
+    multiply_u64(w, power[0], &x_hi, &x_lo);
+    /* the truncated power may have lost a carry: look at the next 64 bits */
+    if (((x_hi & 0x1FF) == 0x1FF) && ((x_lo + w) < w))
+    {
+        uint64_t y_hi = 0;
+        uint64_t y_lo = 0;
+        uint64_t merged_hi = x_hi;
+        uint64_t merged_lo = 0;
+
+        multiply_u64(w, power[1], &y_hi, &y_lo);
+        merged_lo = x_lo + y_hi;
+        if (merged_lo < x_lo)
+        {
+            merged_hi++;
+        }
+        if (((merged_hi & 0x1FF) == 0x1FF) && ((merged_lo + 1) == 0) && ((y_lo + w) < w))
+        {
+            return false;
+        }
+        x_hi = merged_hi;
+        x_lo = merged_lo;
+    }
 
-    /* copy the number into a temporary buffer and replace '.' with the decimal point
-     * of the current locale (for strtod)
-     * This also takes care of '\0' not necessarily being available for marking the end of the input */
+    /* keep 54 bits, then round to 53 */
+    msb = (int)(x_hi >> 63);
+    mantissa = x_hi >> (msb + 9);
+    exponent -= 1 ^ msb;
+    if ((x_lo == 0) && ((x_hi & 0x1FF) == 0) && ((mantissa & 3) == 1))
+    {
+        /* exactly halfway */
+        return false;
+    }
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if ((mantissa >> 53) > 0)
+    {
+        mantissa >>= 1;
+        exponent++;
+    }
+    if ((exponent <= 0) || (exponent >= 0x7FF))
+    {
+        /* subnormal or out of range */
+        return false;
+    }
+
+    bits = ((uint64_t)exponent << 52) | (mantissa & UINT64_C(0x000FFFFFFFFFFFFF));
+    if (negative)
+    {
+        bits |= UINT64_C(1) << 63;
+    }
+    memcpy(result, &bits, sizeof(*result));
+    return true;
+}
+
+/* strtod on a copy of the number with the decimal point of the current locale */
+static size_t parse_number_strtod(const parse_buffer * const input_buffer, double * const number)
+{
+    unsigned char *after_end = NULL;
+    unsigned char number_c_string[64];
+    unsigned char decimal_point = get_decimal_point();
+    size_t i = 0;
+
+    /* This also takes care of '\0' not necessarily being available for marking the end of the input */
     for (i = 0; (i < (sizeof(number_c_string) - 1)) && can_access_at_index(input_buffer, i); i++)
     {
         switch (buffer_at_offset(input_buffer)[i])
@@ -350,11 +759,153 @@ static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_bu
 loop_end:
     number_c_string[i] = '\0';
 
-    number = strtod((const char*)number_c_string, (char**)&after_end);
-    if (number_c_string == after_end)
+    *number = strtod((const char*)number_c_string, (char**)&after_end);
+    return (size_t)(after_end - number_c_string);
+}
+
+/* Parse the input text to generate a number, and populate the result into item. */
+static cJSON_bool parse_number(cJSON * const item, parse_buffer * const input_buffer)
+{
+    const unsigned char *start = NULL;
+    const unsigned char *end = NULL;
+    const unsigned char *p = NULL;
+    double number = 0;
+    uint64_t mantissa = 0;
+    int significant = 0;        /* digits in mantissa, leading zeros not counted */
+    int dropped = 0;            /* significant digits that didn't fit */
+    int exponent = 0;
+    cJSON_bool negative = false;
+    cJSON_bool digits = false;
+    cJSON_bool integer = true;
+    size_t length = 0;
+
+    if ((input_buffer == NULL) || (input_buffer->content == NULL))
+    {
+        return false;
+    }
+
+    start = buffer_at_offset(input_buffer);
+    end = input_buffer->content + input_buffer->length;
+    p = start;
+
+    /* accepts what strtod accepted before: [+-] digits [. digits] [e [+-] digits] */
+    if ((p < end) && ((*p == '-') || (*p == '+')))
+    {
+        negative = (*p == '-');
+        p++;
+    }
+    for (; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+    {
+        digits = true;
+        if (significant < 19)
+        {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            significant += (mantissa != 0);
+        }
+        else
+        {
+            dropped++;
+        }
+    }
+    if ((p < end) && (*p == '.'))
+    {
+        integer = false;
+        for (p++; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+        {
+            digits = true;
+            if (significant < 19)
+            {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                significant += (mantissa != 0);
+                exponent--;
+            }
+            else
+            {
+                dropped++;
+            }
+        }
+    }
+    if (!digits)
     {
         return false; /* parse_error */
     }
+    if (((p + 1) < end) && ((*p == 'e') || (*p == 'E')))
+    {
+        const unsigned char *e = p + 1;
+        cJSON_bool exponent_negative = false;
+        int value = 0;
+
+        if ((*e == '-') || (*e == '+'))
+        {
+            exponent_negative = (*e == '-');
+            e++;
+        }
+        if ((e < end) && (*e >= '0') && (*e <= '9'))
+        {
+            for (; (e < end) && (*e >= '0') && (*e <= '9'); e++)
+            {
+                if (value < 100000)
+                {
+                    value = value * 10 + (*e - '0');
+                }
+            }
+            exponent += exponent_negative ? -value : value;
+            integer = false;
+            p = e;
+        }
+    }
+    length = (size_t)(p - start);
+
+    if ((length >= 64) || (dropped > 0))
+    {
+        /* too many digits for the fast paths */
+        length = parse_number_strtod(input_buffer, &number);
+        if (length == 0)
+        {
+            return false; /* parse_error */
+        }
+    }
+    else if (integer && (mantissa != 0) && (((mantissa >> 63) == 0) || (negative && (mantissa == (UINT64_C(1) << 63)))))
+    {
+        /* exact integer, valueint straight from it */
+        int64_t value = negative ? (int64_t)(0 - mantissa) : (int64_t)mantissa;
+
+        item->valuedouble = (double)value;
+        if (value >= INT_MAX)
+        {
+            item->valueint = INT_MAX;
+        }
+        else if (value <= INT_MIN)
+        {
+            item->valueint = INT_MIN;
+        }
+        else
+        {
+            item->valueint = (int)value;
+        }
+        item->type = cJSON_Number;
+        input_buffer->offset += length;
+        return true;
+    }
+    else if (mantissa == 0)
+    {
+        number = negative ? -0.0 : 0.0;
+    }
+    else if ((mantissa <= (UINT64_C(1) << 53)) && (exponent >= -22) && (exponent <= 22))
+    {
+        /* both operands are exact, so is the rounded result */
+        number = (double)mantissa;
+        number = (exponent < 0) ? number / exact_pow10[-exponent] : number * exact_pow10[exponent];
+        number = negative ? -number : number;
+    }
+    else if (!eisel_lemire(mantissa, exponent, negative, &number))
+    {
+        length = parse_number_strtod(input_buffer, &number);
+        if (length == 0)
+        {
+            return false; /* parse_error */
+        }
+    }
 
     item->valuedouble = number;
 
@@ -374,7 +925,7 @@ loop_end:
 
     item->type = cJSON_Number;
 
-    input_buffer->offset += (size_t)(after_end - number_c_string);
+    input_buffer->offset += length;
     return true;
 }
 
@@ -476,69 +1027,467 @@ static unsigned char* ensure(printbuffer * const p, size_t needed)
         {
             newsize = INT_MAX;
         }
-        else
+        else
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        newsize = needed * 2;
+    }
+
+    if (p->hooks.reallocate != NULL)
+    {
+        /* reallocate with realloc if available */
+        newbuffer = (unsigned char*)p->hooks.reallocate(p->buffer, newsize);
+        if (newbuffer == NULL)
+        {
+            p->hooks.deallocate(p->buffer);
+            p->length = 0;
+            p->buffer = NULL;
+
+            return NULL;
+        }
+    }
+    else
+    {
+        /* otherwise reallocate manually */
+        newbuffer = (unsigned char*)p->hooks.allocate(newsize);
+        if (!newbuffer)
+        {
+            p->hooks.deallocate(p->buffer);
+            p->length = 0;
+            p->buffer = NULL;
+
+            return NULL;
+        }
+
+        memcpy(newbuffer, p->buffer, p->offset + 1);
+        p->hooks.deallocate(p->buffer);
+    }
+    p->length = newsize;
+    p->buffer = newbuffer;
+
+    return newbuffer + p->offset;
+}
+
+/* calculate the new length of the string in a printbuffer and update the offset */
+static void update_offset(printbuffer * const buffer)
+{
+    const unsigned char *buffer_pointer = NULL;
+    if ((buffer == NULL) || (buffer->buffer == NULL))
+    {
+        return;
+    }
+    buffer_pointer = buffer->buffer + buffer->offset;
+
+    buffer->offset += strlen((const char*)buffer_pointer);
+}
+
+/* securely comparison of floating-point variables */
+static cJSON_bool compare_double(double a, double b)
+{
+    double maxVal = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+    return (fabs(a - b) <= maxVal * DBL_EPSILON);
+}
+
+/* Shortest round-trip double to text (Grisu2, Loitsch 2010, after Milo Yip's
+ * implementation). Digits are generated between the neighbours of the value
+ * narrowed by one unit, so the result always reads back to the same double; it
+ * is the shortest such string in all but rare cases. No stdio involved. */
+typedef struct
+{
+    uint64_t f;
+    int e;
+} diy_fp;
+
+#define DP_SIGNIFICAND_MASK UINT64_C(0x000FFFFFFFFFFFFF)
+#define DP_EXPONENT_MASK UINT64_C(0x7FF0000000000000)
+#define DP_HIDDEN_BIT UINT64_C(0x0010000000000000)
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+
+/* 10^k for k = -348, -340, ..., 340, normalized and rounded to nearest */
+static const uint64_t cached_powers_f[] =
+{
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+    UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+    UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+    UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+    UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+    UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+    UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+    UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+    UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+    UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+    UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+    UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+    UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+    UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+    UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b)
+};
+
+static const short cached_powers_e[] =
+{
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066
+};
+
+static const uint64_t pow10_u64[] =
+{
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000),
+    UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000), UINT64_C(100000000),
+    UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000), UINT64_C(100000000000000),
+    UINT64_C(1000000000000000), UINT64_C(10000000000000000), UINT64_C(100000000000000000),
+    UINT64_C(1000000000000000000), UINT64_C(10000000000000000000)
+};
+
+static diy_fp diy_fp_multiply(const diy_fp x, const diy_fp y)
+{
+    const uint64_t mask32 = UINT64_C(0xFFFFFFFF);
+    uint64_t a = x.f >> 32;
+    uint64_t b = x.f & mask32;
+    uint64_t c = y.f >> 32;
+    uint64_t d = y.f & mask32;
+    uint64_t ac = a * c;
+    uint64_t bc = b * c;
+    uint64_t ad = a * d;
+    uint64_t bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & mask32) + (bc & mask32);
+    diy_fp r;
+
+    tmp += UINT64_C(1) << 31; /* round */
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static diy_fp diy_fp_normalize(diy_fp x)
+{
+    while ((x.f & (UINT64_C(1) << 63)) == 0)
+    {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+/* the halfway points to the neighbouring doubles, sharing plus's exponent */
+static void diy_fp_boundaries(const diy_fp v, diy_fp * const minus, diy_fp * const plus)
+{
+    diy_fp pl;
+    diy_fp mi;
+
+    pl.f = (v.f << 1) + 1;
+    pl.e = v.e - 1;
+    while ((pl.f & (DP_HIDDEN_BIT << 1)) == 0)
+    {
+        pl.f <<= 1;
+        pl.e--;
+    }
+    pl.f <<= 64 - DP_SIGNIFICAND_SIZE - 2;
+    pl.e -= 64 - DP_SIGNIFICAND_SIZE - 2;
+
+    /* the gap below a power of two is half as wide */
+    if (v.f == DP_HIDDEN_BIT)
+    {
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    }
+    else
+    {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    *minus = mi;
+    *plus = pl;
+}
+
+/* a cached power that brings a product with exponent e into [-60, -32] */
+static diy_fp cached_power(const int e, int * const decimal_exponent)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    unsigned int index = 0;
+    diy_fp r;
+
+    if ((dk - k) > 0.0)
+    {
+        k++;
+    }
+    index = (unsigned int)((k >> 3) + 1);
+    *decimal_exponent = -(-348 + (int)index * 8);
+
+    r.f = cached_powers_f[index];
+    r.e = cached_powers_e[index];
+    return r;
+}
+
+static void grisu_round(unsigned char * const buffer, const int length, const uint64_t delta, uint64_t rest, const uint64_t ten_kappa, const uint64_t wp_w)
+{
+    while ((rest < wp_w) && ((delta - rest) >= ten_kappa) &&
+           (((rest + ten_kappa) < wp_w) || ((wp_w - rest) > (rest + ten_kappa - wp_w))))
+    {
+        buffer[length - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int count_decimal_digits(const uint32_t n)
+{
+    int digits = 1;
+    uint32_t limit = 10;
+
+    while ((digits < 10) && (n >= limit))
+    {
+        digits++;
+        if (limit > UINT32_MAX / 10)
+        {
+            break;
+        }
+        limit *= 10;
+    }
+    return digits;
+}
+
+static void grisu_digits(const diy_fp w, const diy_fp mp, uint64_t delta, unsigned char * const buffer, int * const length, int * const k)
+{
+    diy_fp one;
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = 0;
+    uint64_t p2 = 0;
+    int kappa = 0;
+
+    one.f = UINT64_C(1) << -mp.e;
+    one.e = mp.e;
+    p1 = (uint32_t)(mp.f >> -one.e);
+    p2 = mp.f & (one.f - 1);
+    kappa = count_decimal_digits(p1);
+    *length = 0;
+
+    while (kappa > 0)
+    {
+        uint32_t divisor = (uint32_t)pow10_u64[kappa - 1];
+        uint32_t d = p1 / divisor;
+        uint64_t rest = 0;
+
+        p1 %= divisor;
+        if ((d != 0) || (*length != 0))
+        {
+            buffer[(*length)++] = (unsigned char)('0' + d);
+        }
+        kappa--;
+        rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta)
+        {
+            *k += kappa;
+            grisu_round(buffer, *length, delta, rest, pow10_u64[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    for (;;)
+    {
+        unsigned char d = 0;
+
+        p2 *= 10;
+        delta *= 10;
+        d = (unsigned char)(p2 >> -one.e);
+        if ((d != 0) || (*length != 0))
+        {
+            buffer[(*length)++] = (unsigned char)('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta)
+        {
+            *k += kappa;
+            grisu_round(buffer, *length, delta, p2, one.f, (-kappa < 20) ? wp_w * pow10_u64[-kappa] : 0);
+            return;
+        }
+    }
+}
+
+/* digits of a positive, finite, non-zero double; value = digits * 10^k */
+static int grisu2(const double value, unsigned char * const digits, int * const k)
+{
+    uint64_t bits = 0;
+    diy_fp v;
+    diy_fp w_minus;
+    diy_fp w_plus;
+    diy_fp c_mk;
+    diy_fp w;
+    diy_fp wp;
+    diy_fp wm;
+    int length = 0;
+    int exponent = 0;
+
+    memcpy(&bits, &value, sizeof(bits));
+    exponent = (int)((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    v.f = bits & DP_SIGNIFICAND_MASK;
+    if (exponent != 0)
+    {
+        v.f += DP_HIDDEN_BIT;
+        v.e = exponent - DP_EXPONENT_BIAS;
+    }
+    else
+    {
+        v.e = 1 - DP_EXPONENT_BIAS;
+    }
+
+    diy_fp_boundaries(v, &w_minus, &w_plus);
+    c_mk = cached_power(w_plus.e, k);
+    w = diy_fp_multiply(diy_fp_normalize(v), c_mk);
+    wp = diy_fp_multiply(w_plus, c_mk);
+    wm = diy_fp_multiply(w_minus, c_mk);
+    wm.f++;
+    wp.f--;
+    grisu_digits(w, wp, wp.f - wm.f, digits, &length, k);
+
+    return length;
+}
+
+static unsigned char *write_exponent(unsigned char *p, int e)
+{
+    *p++ = 'e';
+    if (e < 0)
+    {
+        *p++ = '-';
+        e = -e;
+    }
+    else
+    {
+        *p++ = '+';
+    }
+    if (e >= 100)
+    {
+        *p++ = (unsigned char)('0' + e / 100);
+        e %= 100;
+        *p++ = (unsigned char)('0' + e / 10);
+    }
+    else if (e >= 10)
+    {
+        *p++ = (unsigned char)('0' + e / 10);
+    }
+    *p++ = (unsigned char)('0' + e % 10);
+    return p;
+}
+
+/* Writes d (finite) the way JavaScript's Number.toString does, returns the length.
+ * out needs room for 25 characters. */
+static int format_double(double d, unsigned char * const out)
+{
+    unsigned char digits[20];
+    unsigned char *p = out;
+    int length = 0;
+    int k = 0;
+    int point = 0;
+    int i = 0;
+
+    if (d < 0)
+    {
+        *p++ = '-';
+        d = -d;
+    }
+
+    /* exact integers: no digit generation needed */
+    if (d < 9007199254740992.0)
+    {
+        uint64_t n = (uint64_t)d;
+        if ((double)n == d)
+        {
+            if (n == 0)
+            {
+                /* -0 too */
+                out[0] = '0';
+                return 1;
+            }
+            while (n != 0)
+            {
+                digits[length++] = (unsigned char)('0' + n % 10);
+                n /= 10;
+            }
+            while (length > 0)
+            {
+                *p++ = digits[--length];
+            }
+            return (int)(p - out);
+        }
+    }
+
+    length = grisu2(d, digits, &k);
+    point = length + k; /* position of the decimal point relative to the digits */
+
+    if ((k >= 0) && (point <= 21))
+    {
+        /* 1234e7 -> 12340000000 */
+        memcpy(p, digits, (size_t)length);
+        p += length;
+        for (i = 0; i < k; i++)
         {
-            return NULL;
+            *p++ = '0';
         }
     }
-    else
+    else if ((point > 0) && (point <= 21))
     {
-        newsize = needed * 2;
+        /* 1234e-2 -> 12.34 */
+        memcpy(p, digits, (size_t)point);
+        p += point;
+        *p++ = '.';
+        memcpy(p, digits + point, (size_t)(length - point));
+        p += length - point;
     }
-
-    if (p->hooks.reallocate != NULL)
+    else if ((point > -6) && (point <= 0))
     {
-        /* reallocate with realloc if available */
-        newbuffer = (unsigned char*)p->hooks.reallocate(p->buffer, newsize);
-        if (newbuffer == NULL)
+        /* 1234e-6 -> 0.001234 */
+        *p++ = '0';
+        *p++ = '.';
+        for (i = point; i < 0; i++)
         {
-            p->hooks.deallocate(p->buffer);
-            p->length = 0;
-            p->buffer = NULL;
-
-            return NULL;
+            *p++ = '0';
         }
+        memcpy(p, digits, (size_t)length);
+        p += length;
     }
     else
     {
-        /* otherwise reallocate manually */
-        newbuffer = (unsigned char*)p->hooks.allocate(newsize);
-        if (!newbuffer)
+        /* 1234e30 -> 1.234e+33 */
+        *p++ = digits[0];
+        if (length > 1)
         {
-            p->hooks.deallocate(p->buffer);
-            p->length = 0;
-            p->buffer = NULL;
-
-            return NULL;
+            *p++ = '.';
+            memcpy(p, digits + 1, (size_t)(length - 1));
+            p += length - 1;
         }
-
-        memcpy(newbuffer, p->buffer, p->offset + 1);
-        p->hooks.deallocate(p->buffer);
-    }
-    p->length = newsize;
-    p->buffer = newbuffer;
-
-    return newbuffer + p->offset;
-}
-
-/* calculate the new length of the string in a printbuffer and update the offset */
-static void update_offset(printbuffer * const buffer)
-{
-    const unsigned char *buffer_pointer = NULL;
-    if ((buffer == NULL) || (buffer->buffer == NULL))
-    {
-        return;
+        p = write_exponent(p, point - 1);
     }
-    buffer_pointer = buffer->buffer + buffer->offset;
-
-    buffer->offset += strlen((const char*)buffer_pointer);
-}
 
-/* securely comparison of floating-point variables */
-static cJSON_bool compare_double(double a, double b)
-{
-    double maxVal = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
-    return (fabs(a - b) <= maxVal * DBL_EPSILON);
+    return (int)(p - out);
 }
 
 /* Render the number nicely from the given item into a string. */
@@ -547,10 +1496,7 @@ static cJSON_bool print_number(const cJSON * const item, printbuffer * const out
     unsigned char *output_pointer = NULL;
     double d = item->valuedouble;
     int length = 0;
-    size_t i = 0;
     unsigned char number_buffer[26] = {0}; /* temporary buffer to print the number into */
-    unsigned char decimal_point = get_decimal_point();
-    double test = 0.0;
 
     if (output_buffer == NULL)
     {
@@ -560,29 +1506,12 @@ static cJSON_bool print_number(const cJSON * const item, printbuffer * const out
     /* This checks for NaN and Infinity */
     if (isnan(d) || isinf(d))
     {
-        length = sprintf((char*)number_buffer, "null");
+        length = (int)static_strlen("null");
+        memcpy(number_buffer, "null", sizeof("null"));
     }
-	else if(d == (double)item->valueint)
-	{
-		length = sprintf((char*)number_buffer, "%d", item->valueint);
-	}
     else
     {
-        /* Try 15 decimal places of precision to avoid nonsignificant nonzero digits */
-        length = sprintf((char*)number_buffer, "%1.15g", d);
-
-        /* Check whether the original double can be recovered */
-        if ((sscanf((char*)number_buffer, "%lg", &test) != 1) || !compare_double((double)test, d))
-        {
-            /* If not, print with 17 decimal places of precision */
-            length = sprintf((char*)number_buffer, "%1.17g", d);
-        }
-    }
-
-    /* sprintf failed or buffer overrun occurred */
-    if ((length < 0) || (length > (int)(sizeof(number_buffer) - 1)))
-    {
-        return false;
+        length = format_double(d, number_buffer);
     }
 
     /* reserve appropriate space in the output */
@@ -592,19 +1521,9 @@ static cJSON_bool print_number(const cJSON * const item, printbuffer * const out
         return false;
     }
 
-    /* copy the printed number to the output and replace locale
-     * dependent decimal point with '.' */
-    for (i = 0; i < ((size_t)length); i++)
-    {
-        if (number_buffer[i] == decimal_point)
-        {
-            output_pointer[i] = '.';
-            continue;
-        }
-
-        output_pointer[i] = number_buffer[i];
-    }
-    output_pointer[i] = '\0';
+    /* always '.', whatever the locale */
+    memcpy(output_pointer, number_buffer, (size_t)length);
+    output_pointer[length] = '\0';
 
     output_buffer->offset += (size_t)length;
 
@@ -1308,6 +2227,33 @@ CJSON_PUBLIC(cJSON_bool) cJSON_PrintPreallocated(cJSON *item, char *buffer, cons
     return print_value(item, &p);
 }
 
+CJSON_PUBLIC(size_t) cJSON_PrintInto(const cJSON *item, char *buffer, size_t size, const cJSON_bool format)
+{
+    printbuffer p = { 0, 0, 0, 0, 0, 0, { 0, 0, 0 } };
+
+    if ((item == NULL) || (buffer == NULL) || (size == 0))
+    {
+        return 0;
+    }
+
+    p.buffer = (unsigned char*)buffer;
+    p.length = size;
+    p.offset = 0;
+    p.noalloc = true;
+    p.format = format;
+    p.hooks = global_hooks;
+
+    if (!print_value(item, &p))
+    {
+        /* never leave a truncated document behind */
+        buffer[0] = '\0';
+        return 0;
+    }
+    update_offset(&p);
+
+    return p.offset;
+}
+
 /* Parser core - when encountering text, process appropriately. */
 static cJSON_bool parse_value(cJSON * const item, parse_buffer * const input_buffer)
 {
@@ -1877,21 +2823,295 @@ CJSON_PUBLIC(cJSON *) cJSON_GetArrayItem(const cJSON *array, int index)
     return get_array_item(array, (size_t)index);
 }
 
+#if defined(__clang__) || (defined(__GNUC__)  && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 5))))
+    #pragma GCC diagnostic push
+#endif
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#endif
+/* helper function to cast away const */
+static void* cast_away_const(const void* string)
+{
+    return (void*)string;
+}
+#if defined(__clang__) || (defined(__GNUC__)  && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 5))))
+    #pragma GCC diagnostic pop
+#endif
+
+/* Object index: open addressing with linear probing over the member pointers, one
+ * table per kind of lookup. Only the first member with a given key is entered, which
+ * keeps the linear scan's answer for duplicate keys. Tables stay at most 3/4 full. */
+typedef struct cJSON_Index
+{
+    size_t mask; /* slots - 1 */
+    size_t members;
+    cJSON **table[2]; /* [case_sensitive], NULL until that kind is looked up */
+    cJSON_bool duplicates[2];
+} cJSON_Index;
+
+static size_t index_hash(const unsigned char *key, const cJSON_bool case_sensitive)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261U;
+
+    for (; *key != '\0'; key++)
+    {
+        hash ^= case_sensitive ? *key : (unsigned char)tolower(*key);
+        hash *= 16777619U;
+    }
+    return (size_t)hash;
+}
+
+static cJSON_bool index_keys_equal(const char *a, const char *b, const cJSON_bool case_sensitive)
+{
+    if (case_sensitive)
+    {
+        return strcmp(a, b) == 0;
+    }
+    return case_insensitive_strcmp((const unsigned char*)a, (const unsigned char*)b) == 0;
+}
+
+/* false if a member with an equal key is in the table already */
+static cJSON_bool index_insert(cJSON ** const table, const size_t mask, cJSON * const item, const cJSON_bool case_sensitive)
+{
+    size_t slot = index_hash((const unsigned char*)item->string, case_sensitive) & mask;
+
+    while (table[slot] != NULL)
+    {
+        if (index_keys_equal(table[slot]->string, item->string, case_sensitive))
+        {
+            return false;
+        }
+        slot = (slot + 1) & mask;
+    }
+    table[slot] = item;
+    return true;
+}
+
+static cJSON **index_find(cJSON ** const table, const size_t mask, const char * const name, const cJSON_bool case_sensitive)
+{
+    size_t slot = index_hash((const unsigned char*)name, case_sensitive) & mask;
+
+    while (table[slot] != NULL)
+    {
+        if (index_keys_equal(table[slot]->string, name, case_sensitive))
+        {
+            return &table[slot];
+        }
+        slot = (slot + 1) & mask;
+    }
+    return NULL;
+}
+
+static void index_remove(cJSON ** const table, const size_t mask, const cJSON * const item, const cJSON_bool case_sensitive)
+{
+    cJSON **found = index_find(table, mask, item->string, case_sensitive);
+    size_t hole = 0;
+    size_t slot = 0;
+
+    if ((found == NULL) || (*found != item))
+    {
+        return;
+    }
+
+    /* shift later members of the probe run back into the hole */
+    hole = (size_t)(found - table);
+    *found = NULL;
+    for (slot = (hole + 1) & mask; table[slot] != NULL; slot = (slot + 1) & mask)
+    {
+        size_t home = index_hash((const unsigned char*)table[slot]->string, case_sensitive) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask))
+        {
+            table[hole] = table[slot];
+            table[slot] = NULL;
+            hole = slot;
+        }
+    }
+}
+
+CJSON_PUBLIC(void) cJSON_InvalidateIndex(cJSON *object)
+{
+    if ((object == NULL) || (object->index == NULL))
+    {
+        return;
+    }
+
+    if (object->index->table[0] != NULL)
+    {
+        global_hooks.deallocate(object->index->table[0]);
+    }
+    if (object->index->table[1] != NULL)
+    {
+        global_hooks.deallocate(object->index->table[1]);
+    }
+    global_hooks.deallocate(object->index);
+    object->index = NULL;
+}
+
+static void index_build(cJSON * const object, const cJSON_bool case_sensitive)
+{
+    cJSON_Index *index = object->index;
+    cJSON *child = NULL;
+    cJSON **table = NULL;
+    size_t members = 0;
+    size_t slots = 4;
+
+    /* References share their members with another object that could change them behind
+     * our back, and an index in an arena would dangle after the reset. */
+    if (((object->type & 0xFF) != cJSON_Object) || (object->type & cJSON_IsReference) || (current_arena != NULL))
+    {
+        return;
+    }
+
+    for (child = object->child; child != NULL; child = child->next)
+    {
+        if (child->string == NULL)
+        {
+            /* not a proper object, leave it to the linear scan */
+            return;
+        }
+        members++;
+    }
+
+    if (index == NULL)
+    {
+        while ((slots - slots / 4) < members)
+        {
+            slots *= 2;
+        }
+        index = (cJSON_Index*)global_hooks.allocate(sizeof(cJSON_Index));
+        if (index == NULL)
+        {
+            return;
+        }
+        memset(index, '\0', sizeof(cJSON_Index));
+        index->mask = slots - 1;
+        index->members = members;
+        object->index = index;
+    }
+
+    table = (cJSON**)global_hooks.allocate((index->mask + 1) * sizeof(cJSON*));
+    if (table == NULL)
+    {
+        return;
+    }
+    memset(table, '\0', (index->mask + 1) * sizeof(cJSON*));
+    for (child = object->child; child != NULL; child = child->next)
+    {
+        if (!index_insert(table, index->mask, child, case_sensitive))
+        {
+            index->duplicates[case_sensitive ? 1 : 0] = true;
+        }
+    }
+    index->table[case_sensitive ? 1 : 0] = table;
+}
+
+/* item was appended to object */
+static void index_added(cJSON * const object, cJSON * const item)
+{
+    cJSON_Index *index = object->index;
+    int kind = 0;
+
+    if (index == NULL)
+    {
+        return;
+    }
+    index->members++;
+    if ((item->string == NULL) || ((index->members + index->members / 3) > index->mask + 1))
+    {
+        /* rebuilt bigger on the next long lookup */
+        cJSON_InvalidateIndex(object);
+        return;
+    }
+    for (kind = 0; kind < 2; kind++)
+    {
+        if ((index->table[kind] != NULL) && !index_insert(index->table[kind], index->mask, item, kind == 1))
+        {
+            index->duplicates[kind] = true;
+        }
+    }
+}
+
+static void index_removed(cJSON * const object, const cJSON * const item)
+{
+    cJSON_Index *index = object->index;
+    int kind = 0;
+
+    if (index == NULL)
+    {
+        return;
+    }
+    if (index->duplicates[0] || index->duplicates[1] || (item->string == NULL))
+    {
+        /* another member with the key may have to take its place */
+        cJSON_InvalidateIndex(object);
+        return;
+    }
+    for (kind = 0; kind < 2; kind++)
+    {
+        if (index->table[kind] != NULL)
+        {
+            index_remove(index->table[kind], index->mask, item, kind == 1);
+        }
+    }
+    index->members--;
+}
+
+/* replacement took item's place in object */
+static void index_replaced(cJSON * const object, const cJSON * const item, cJSON * const replacement)
+{
+    cJSON_Index *index = object->index;
+    cJSON **found = NULL;
+    int kind = 0;
+
+    if (index == NULL)
+    {
+        return;
+    }
+    for (kind = 0; kind < 2; kind++)
+    {
+        if (index->table[kind] == NULL)
+        {
+            continue;
+        }
+        if (index->duplicates[kind] || (item->string == NULL) || (replacement->string == NULL) ||
+            !index_keys_equal(item->string, replacement->string, kind == 1))
+        {
+            cJSON_InvalidateIndex(object);
+            return;
+        }
+        found = index_find(index->table[kind], index->mask, item->string, kind == 1);
+        if ((found != NULL) && (*found == item))
+        {
+            *found = replacement;
+        }
+    }
+}
+
 static cJSON *get_object_item(const cJSON * const object, const char * const name, const cJSON_bool case_sensitive)
 {
     cJSON *current_element = NULL;
+    cJSON **found = NULL;
+    size_t walked = 0;
 
     if ((object == NULL) || (name == NULL))
     {
         return NULL;
     }
 
+    if ((object->index != NULL) && (object->index->table[case_sensitive ? 1 : 0] != NULL))
+    {
+        found = index_find(object->index->table[case_sensitive ? 1 : 0], object->index->mask, name, case_sensitive);
+        return (found != NULL) ? *found : NULL;
+    }
+
     current_element = object->child;
     if (case_sensitive)
     {
         while ((current_element != NULL) && (current_element->string != NULL) && (strcmp(name, current_element->string) != 0))
         {
             current_element = current_element->next;
+            walked++;
         }
     }
     else
@@ -1899,9 +3119,20 @@ static cJSON *get_object_item(const cJSON * const object, const char * const nam
         while ((current_element != NULL) && (case_insensitive_strcmp((const unsigned char*)name, (const unsigned char*)(current_element->string)) != 0))
         {
             current_element = current_element->next;
+            walked++;
         }
     }
 
+#if CJSON_INDEX_THRESHOLD > 0
+    if (walked >= CJSON_INDEX_THRESHOLD)
+    {
+        /* this was a long walk, the next one won't be */
+        index_build((cJSON*)cast_away_const(object), case_sensitive);
+    }
+#else
+    (void)walked;
+#endif
+
     if ((current_element == NULL) || (current_element->string == NULL)) {
         return NULL;
     }
@@ -1950,6 +3181,7 @@ static cJSON *create_reference(const cJSON *item, const internal_hooks * const h
     reference->string = NULL;
     reference->type |= cJSON_IsReference;
     reference->next = reference->prev = NULL;
+    reference->index = NULL;
     return reference;
 }
 
@@ -1982,6 +3214,7 @@ static cJSON_bool add_item_to_array(cJSON *array, cJSON *item)
             array->child->prev = item;
         }
     }
+    index_added(array, item);
 
     return true;
 }
@@ -1992,20 +3225,6 @@ CJSON_PUBLIC(cJSON_bool) cJSON_AddItemToArray(cJSON *array, cJSON *item)
     return add_item_to_array(array, item);
 }
 
-#if defined(__clang__) || (defined(__GNUC__)  && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 5))))
-    #pragma GCC diagnostic push
-#endif
-#ifdef __GNUC__
-#pragma GCC diagnostic ignored "-Wcast-qual"
-#endif
-/* helper function to cast away const */
-static void* cast_away_const(const void* string)
-{
-    return (void*)string;
-}
-#if defined(__clang__) || (defined(__GNUC__)  && ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ > 5))))
-    #pragma GCC diagnostic pop
-#endif
 
 
 static cJSON_bool add_item_to_object(cJSON * const object, const char * const string, cJSON * const item, const internal_hooks * const hooks, const cJSON_bool constant_key)
@@ -2190,6 +3409,7 @@ CJSON_PUBLIC(cJSON *) cJSON_DetachItemViaPointer(cJSON *parent, cJSON * const it
     {
         return NULL;
     }
+    index_removed(parent, item);
 
     if (item != parent->child)
     {
@@ -2275,6 +3495,8 @@ CJSON_PUBLIC(cJSON_bool) cJSON_InsertItemInArray(cJSON *array, int which, cJSON
         return add_item_to_array(array, newitem);
     }
 
+    /* ahead of other members it could shadow one with the same key */
+    cJSON_InvalidateIndex(array);
     newitem->next = after_inserted;
     newitem->prev = after_inserted->prev;
     after_inserted->prev = newitem;
@@ -2301,6 +3523,7 @@ CJSON_PUBLIC(cJSON_bool) cJSON_ReplaceItemViaPointer(cJSON * const parent, cJSON
         return true;
     }
 
+    index_replaced(parent, item, replacement);
     replacement->next = item->next;
     replacement->prev = item->prev;
 
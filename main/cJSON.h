@@ -120,6 +120,9 @@ typedef struct cJSON
 
     /* The item's name string, if this item is the child of, or is in the list of subitems of an object. */
     char *string;
+
+    /* Hash index over an object's members, built on demand. Internal. */
+    struct cJSON_Index *index;
 } cJSON;
 
 typedef struct cJSON_Hooks
@@ -137,12 +140,42 @@ typedef int cJSON_bool;
 #define CJSON_NESTING_LIMIT 1000
 #endif
 
+/* Once a key lookup has to walk past this many members of an object, the object gets
+ * a hash index and later lookups of the same kind (case sensitive or not) take O(1).
+ * 0 disables indexing. */
+#ifndef CJSON_INDEX_THRESHOLD
+#define CJSON_INDEX_THRESHOLD 16
+#endif
+
 /* returns the version of cJSON as a string */
 CJSON_PUBLIC(const char*) cJSON_Version(void);
 
 /* Supply malloc, realloc and free functions to cJSON */
 CJSON_PUBLIC(void) cJSON_InitHooks(cJSON_Hooks* hooks);
 
+/* Bump arena for whole documents. Between cJSON_ArenaBegin and cJSON_ArenaEnd every
+ * allocation cJSON makes on the calling thread comes from the arena's memory, freeing
+ * it is a no-op and cJSON_ArenaReset releases everything at once, so cJSON_Delete and
+ * cJSON_free are not needed. An allocation that doesn't fit fails like malloc would.
+ * Documents must not outlive the reset, and must not be freed after cJSON_ArenaEnd.
+ * Arenas nest; other threads keep using the hooks from cJSON_InitHooks. */
+typedef struct cJSON_Arena
+{
+    unsigned char *memory;
+    size_t size;
+    size_t used;
+    size_t last; /* offset of the most recent allocation */
+    size_t high_water;
+    size_t allocations;
+    size_t failures;
+    struct cJSON_Arena *previous;
+} cJSON_Arena;
+
+CJSON_PUBLIC(void) cJSON_ArenaInit(cJSON_Arena *arena, void *memory, size_t size);
+CJSON_PUBLIC(void) cJSON_ArenaBegin(cJSON_Arena *arena);
+CJSON_PUBLIC(void) cJSON_ArenaEnd(cJSON_Arena *arena);
+CJSON_PUBLIC(void) cJSON_ArenaReset(cJSON_Arena *arena);
+
 /* Memory Management: the caller is always responsible to free the results from all variants of cJSON_Parse (with cJSON_Delete) and cJSON_Print (with stdlib free, cJSON_Hooks.free_fn, or cJSON_free as appropriate). The exception is cJSON_PrintPreallocated, where the caller has full responsibility of the buffer. */
 /* Supply a block of JSON, and this returns a cJSON object you can interrogate. */
 CJSON_PUBLIC(cJSON *) cJSON_Parse(const char *value);
@@ -161,6 +194,10 @@ CJSON_PUBLIC(char *) cJSON_PrintBuffered(const cJSON *item, int prebuffer, cJSON
 /* Render a cJSON entity to text using a buffer already allocated in memory with given length. Returns 1 on success and 0 on failure. */
 /* NOTE: cJSON is not always 100% accurate in estimating how much memory it will use, so to be safe allocate 5 bytes more than you actually need */
 CJSON_PUBLIC(cJSON_bool) cJSON_PrintPreallocated(cJSON *item, char *buffer, const int length, const cJSON_bool format);
+/* Renders into a caller-owned buffer without allocating. Returns the length written,
+ * excluding the terminator, or 0 if it doesn't fit, in which case the buffer holds an
+ * empty string. Never writes past size; needs one spare byte after the terminator. */
+CJSON_PUBLIC(size_t) cJSON_PrintInto(const cJSON *item, char *buffer, size_t size, const cJSON_bool format);
 /* Delete a cJSON entity and all subentities. */
 CJSON_PUBLIC(void) cJSON_Delete(cJSON *item);
 
@@ -171,6 +208,10 @@ CJSON_PUBLIC(cJSON *) cJSON_GetArrayItem(const cJSON *array, int index);
 /* Get item "string" from object. Case insensitive. */
 CJSON_PUBLIC(cJSON *) cJSON_GetObjectItem(const cJSON * const object, const char * const string);
 CJSON_PUBLIC(cJSON *) cJSON_GetObjectItemCaseSensitive(const cJSON * const object, const char * const string);
+/* Lookups may build an index on the object, so they are not read-only: don't look up keys
+ * in the same object from several threads at once. The functions here keep the index in
+ * step with the object; code that relinks members or renames keys itself must drop it. */
+CJSON_PUBLIC(void) cJSON_InvalidateIndex(cJSON *object);
 CJSON_PUBLIC(cJSON_bool) cJSON_HasObjectItem(const cJSON *object, const char *string);
 /* For analysing failed parses. This returns a pointer to the parse error. You'll probably need to look a few chars back to make sense of it. Defined when cJSON_Parse() returns 0. 0 when cJSON_Parse() succeeds. */
 CJSON_PUBLIC(const char *) cJSON_GetErrorPtr(void);
@@ -599,6 +599,8 @@ static void sort_object(cJSON * const object, const cJSON_bool case_sensitive)
         return;
     }
     object->child = sort_list(object->child, case_sensitive);
+    /* the first of several equal keys may have changed */
+    cJSON_InvalidateIndex(object);
 }
 
 static cJSON_bool compare_json(cJSON *a, cJSON *b, const cJSON_bool case_sensitive)
@@ -800,6 +802,7 @@ static void overwrite_item(cJSON * const root, const cJSON replacement)
     {
         cJSON_Delete(root->child);
     }
+    cJSON_InvalidateIndex(root);
 
     memcpy(root, &replacement, sizeof(cJSON));
 }
@@ -840,7 +843,7 @@ static int apply_patch(cJSON *object, const cJSON *patch, const cJSON_bool case_
     {
         if (opcode == REMOVE)
         {
-            static const cJSON invalid = { NULL, NULL, NULL, cJSON_Invalid, NULL, 0, 0, NULL};
+            static const cJSON invalid = { NULL, NULL, NULL, cJSON_Invalid, NULL, 0, 0, NULL, NULL};
 
             overwrite_item(object, invalid);
 
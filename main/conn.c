@@ -0,0 +1,93 @@
+#include <inttypes.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+
+#include "conn.h"
+
+#define TAG "CONN"
+
+#define CONN_QUEUE_LEN 16
+
+static const char *state_names[] = {"wifi_wait", "ws_wait", "handshake", "streaming"};
+
+static QueueHandle_t conn_q;
+static portMUX_TYPE conn_lock = portMUX_INITIALIZER_UNLOCKED;
+static conn_stats_t stats = { .state = CONN_WIFI_WAIT };
+static int64_t down_since_us = 0;
+
+void conn_init(void)
+{
+    if (!conn_q) conn_q = xQueueCreate(CONN_QUEUE_LEN, sizeof(conn_event_t));
+}
+
+// Called from the Wi-Fi and websocket event handlers, so it never blocks.
+void conn_post(conn_event_t ev)
+{
+    if (conn_q && xQueueSend(conn_q, &ev, 0) != pdTRUE)
+        ESP_LOGW(TAG, "Event queue full, dropped event %d", ev);
+}
+
+int conn_wait(conn_event_t *ev, TickType_t wait)
+{
+    return conn_q && xQueueReceive(conn_q, ev, wait) == pdTRUE;
+}
+
+void conn_set_state(conn_state_t state)
+{
+    int64_t now = esp_timer_get_time();
+    conn_state_t prev = stats.state;
+    uint32_t recover_ms = 0;
+
+    if (state == prev) return;
+
+    portENTER_CRITICAL(&conn_lock);
+    if (prev == CONN_STREAMING) {
+        down_since_us = now;
+        stats.outages++;
+    }
+    else if (state == CONN_STREAMING && down_since_us) {
+        recover_ms = (uint32_t)((now - down_since_us) / 1000);
+        stats.recover_last_ms = recover_ms;
+        if (recover_ms > stats.recover_max_ms) stats.recover_max_ms = recover_ms;
+        stats.recover_sum_ms += recover_ms;
+        down_since_us = 0;
+    }
+    stats.state = state;
+    portEXIT_CRITICAL(&conn_lock);
+
+    if (recover_ms)
+        ESP_LOGW(TAG, "%s -> %s, recovered in %" PRIu32 " ms", state_names[prev], state_names[state], recover_ms);
+    else
+        ESP_LOGI(TAG, "%s -> %s", state_names[prev], state_names[state]);
+}
+
+conn_state_t conn_get_state(void)
+{
+    return stats.state;
+}
+
+void conn_get_stats(conn_stats_t *out)
+{
+    portENTER_CRITICAL(&conn_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&conn_lock);
+}
+
+uint32_t conn_backoff_next(conn_backoff_t *b)
+{
+    uint32_t half;
+
+    if (!b->cur_ms) b->cur_ms = b->base_ms;
+    else if (b->cur_ms < b->max_ms) b->cur_ms = b->cur_ms * 2 < b->max_ms ? b->cur_ms * 2 : b->max_ms;
+    half = b->cur_ms / 2;
+    return half + esp_random() % (b->cur_ms - half + 1);
+}
+
+void conn_backoff_reset(conn_backoff_t *b)
+{
+    b->cur_ms = 0;
+}
@@ -0,0 +1,43 @@
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+
+typedef enum {
+    CONN_EV_WIFI_UP,
+    CONN_EV_WIFI_DOWN,
+    CONN_EV_WS_UP,
+    CONN_EV_WS_DOWN,
+    CONN_EV_HANDSHAKE,  // The server answered audio_stream_start.
+} conn_event_t;
+
+typedef enum {
+    CONN_WIFI_WAIT,     // No IP.
+    CONN_WS_WAIT,       // Websocket client (re)connecting.
+    CONN_HANDSHAKE,     // audio_stream_start sent, waiting for the UDP port.
+    CONN_STREAMING,
+} conn_state_t;
+
+// Exponential backoff with equal jitter: each delay is drawn from
+// [cur/2, cur] and cur doubles up to max_ms.
+typedef struct {
+    uint32_t base_ms;
+    uint32_t max_ms;
+    uint32_t cur_ms;
+} conn_backoff_t;
+
+typedef struct {
+    conn_state_t state;
+    uint32_t outages;
+    uint32_t recover_last_ms;   // Streaming lost -> streaming again.
+    uint32_t recover_max_ms;
+    uint64_t recover_sum_ms;
+} conn_stats_t;
+
+void conn_init(void);
+void conn_post(conn_event_t ev);
+int conn_wait(conn_event_t *ev, TickType_t wait);
+void conn_set_state(conn_state_t state);
+conn_state_t conn_get_state(void);
+void conn_get_stats(conn_stats_t *stats);
+
+uint32_t conn_backoff_next(conn_backoff_t *b);
+void conn_backoff_reset(conn_backoff_t *b);
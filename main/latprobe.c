@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "latprobe.h"
+#include "timesync.h"
+#include "network.h"
+
+#define TAG "LATPROBE"
+
+#ifndef CONFIG_LATPROBE_PERIOD_MS
+#define CONFIG_LATPROBE_PERIOD_MS 1000
+#endif
+#ifndef CONFIG_LATPROBE_THRESHOLD
+#define CONFIG_LATPROBE_THRESHOLD 400
+#endif
+#ifndef CONFIG_LATPROBE_REPORT
+#define CONFIG_LATPROBE_REPORT 30
+#endif
+
+/* A probed sample has bit 15 set. After handing its block to the transport
+ * the device announces it:
+ *   -> {"type":"latency_probe","client":"ESP32","id":3,"capture":<us>,"emit":<us>}
+ * and the server answers with the time it received the marked sample:
+ *   <- {"type":"latency_probe","id":3,"rx":<us>}
+ * All three times are on the server clock (see timesync.c), so the stages
+ * can be told apart without trusting either side's clock alone. */
+
+#define LATPROBE_MARKER 0x8000
+#define MAX_PENDING 8
+
+typedef struct {
+    int id;
+    int64_t capture_us;
+    int64_t emit_us;
+} probe_t;
+
+static portMUX_TYPE probe_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static probe_t pending[MAX_PENDING];
+static int next_id = 1;
+static latprobe_stats_t stats;
+
+// Capture task only.
+static int64_t last_mark_us = 0;
+static int32_t dc = -1;     // Slow running mean, 4 fractional bits.
+
+static const uint32_t edges[LATPROBE_BUCKETS - 1] = LATPROBE_BUCKET_EDGES;
+static const char *stage_names[LATPROBE_STAGES] = {"capture", "network", "total"};
+
+// Index of the sample to probe, -1 for none.
+static int find_probe(const uint16_t samps[], int n, int64_t capture_us, int rate)
+{
+#if CONFIG_LATPROBE_TRANSIENT
+    // First sample that jumps away from the running mean after a quiet spell.
+    int found = -1;
+    for (int i = 0; i < n; i++) {
+        int32_t x = (int32_t)(samps[i] & 0x0FFF) << 4;
+        if (dc < 0) dc = x;
+        int32_t dev = (x > dc ? x - dc : dc - x) >> 4;
+        if (found < 0 && dev > CONFIG_LATPROBE_THRESHOLD &&
+            capture_us + (int64_t)i * 1000000 / rate - last_mark_us >= CONFIG_LATPROBE_PERIOD_MS * 1000LL)
+            found = i;
+        dc += (x - dc) >> 8;
+    }
+    return found;
+#else
+    return capture_us - last_mark_us >= CONFIG_LATPROBE_PERIOD_MS * 1000LL ? 0 : -1;
+#endif
+}
+
+int latprobe_mark(uint16_t samps[], int n, int64_t capture_us, int rate)
+{
+    int idx = find_probe(samps, n, capture_us, rate);
+    int64_t t, server_us;
+    int id;
+
+    if (idx < 0) return 0;
+    t = capture_us + (int64_t)idx * 1000000 / rate;
+    last_mark_us = t;
+    if (!timesync_to_server(t, &server_us)) {
+        portENTER_CRITICAL(&probe_lock);
+        stats.unsynced++;
+        portEXIT_CRITICAL(&probe_lock);
+        return 0;
+    }
+    samps[idx] |= LATPROBE_MARKER;
+
+    portENTER_CRITICAL(&probe_lock);
+    id = next_id++;
+    probe_t *p = &pending[id % MAX_PENDING];
+    if (p->id) stats.expired++;
+    p->id = id;
+    p->capture_us = server_us;
+    p->emit_us = 0;
+    stats.marked++;
+    portEXIT_CRITICAL(&probe_lock);
+    return id;
+}
+
+void latprobe_sent(int id)
+{
+    int64_t server_us, capture_us;
+    char json[128];
+
+    if (!id || !timesync_to_server(esp_timer_get_time(), &server_us)) return;
+
+    portENTER_CRITICAL(&probe_lock);
+    probe_t *p = &pending[id % MAX_PENDING];
+    if (p->id == id) p->emit_us = server_us;
+    capture_us = p->capture_us;
+    portEXIT_CRITICAL(&probe_lock);
+
+    snprintf(json, sizeof(json),
+             "{\"type\":\"latency_probe\",\"client\":\"ESP32\",\"id\":%d,\"capture\":%" PRId64 ",\"emit\":%" PRId64 "}",
+             id, capture_us, server_us);
+    send_ws(json, 0);
+}
+
+static void hist_add(latprobe_hist_t *h, int64_t us)
+{
+    uint32_t v = us < 0 ? 0 : (uint32_t)us;
+    int b = 0;
+
+    while (b < LATPROBE_BUCKETS - 1 && v >= edges[b]) b++;
+    h->hist[b]++;
+    if (!h->count || v < h->min_us) h->min_us = v;
+    if (v > h->max_us) h->max_us = v;
+    h->count++;
+    h->sum_us += v;
+}
+
+static void log_report(const latprobe_stats_t *s)
+{
+    ESP_LOGI(TAG, "%" PRIu32 " probes, %" PRIu32 " answered, %" PRIu32 " expired",
+             s->marked, s->answered, s->expired);
+    for (int i = 0; i < LATPROBE_STAGES; i++) {
+        const latprobe_hist_t *h = &s->stage[i];
+        char line[160];
+        int len = 0;
+
+        if (!h->count) continue;
+        for (int b = 0; b < LATPROBE_BUCKETS; b++) {
+            if (b < LATPROBE_BUCKETS - 1)
+                len += snprintf(line + len, sizeof(line) - len, " <%" PRIu32 ":%" PRIu32, edges[b] / 1000, h->hist[b]);
+            else
+                len += snprintf(line + len, sizeof(line) - len, " more:%" PRIu32, h->hist[b]);
+        }
+        ESP_LOGI(TAG, "%-7s avg %" PRIu32 " min %" PRIu32 " max %" PRIu32 " us |%s", stage_names[i],
+                 (uint32_t)(h->sum_us / h->count), h->min_us, h->max_us, line);
+    }
+}
+
+void latprobe_on_message(const wsmsg_t *msg)
+{
+    double id, rx;
+    probe_t p = {0};
+    latprobe_stats_t snap;
+    int report = 0;
+
+    if (!wsmsg_get_num(msg, "id", &id) || !wsmsg_get_num(msg, "rx", &rx)) return;
+
+    portENTER_CRITICAL(&probe_lock);
+    // Only ids we handed out; the range check comes first so the cast is defined.
+    if (!(id >= 1 && id < next_id) || id != (double)(int)id) {
+        portEXIT_CRITICAL(&probe_lock);
+        return;
+    }
+    probe_t *slot = &pending[(int)id % MAX_PENDING];
+    if (slot->id == (int)id && slot->emit_us) {
+        p = *slot;
+        slot->id = 0;
+    }
+    if (p.id) {
+        hist_add(&stats.stage[LATPROBE_CAPTURE], p.emit_us - p.capture_us);
+        hist_add(&stats.stage[LATPROBE_NETWORK], (int64_t)rx - p.emit_us);
+        hist_add(&stats.stage[LATPROBE_TOTAL], (int64_t)rx - p.capture_us);
+        stats.answered++;
+        report = stats.answered % CONFIG_LATPROBE_REPORT == 0;
+        snap = stats;
+    }
+    portEXIT_CRITICAL(&probe_lock);
+
+    if (report) log_report(&snap);
+}
+
+void latprobe_get_stats(latprobe_stats_t *out, int reset)
+{
+    portENTER_CRITICAL(&probe_lock);
+    *out = stats;
+    if (reset) memset(&stats, 0, sizeof(stats));
+    portEXIT_CRITICAL(&probe_lock);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include "wsmsg.h"
+
+// Upper bucket edges in us; the last bucket catches everything above.
+#define LATPROBE_BUCKETS 10
+#define LATPROBE_BUCKET_EDGES {1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000}
+
+typedef enum {
+    LATPROBE_CAPTURE,   // Sample captured -> handed to the transport.
+    LATPROBE_NETWORK,   // Handed to the transport -> received by the server.
+    LATPROBE_TOTAL,     // Sample captured -> received by the server.
+    LATPROBE_STAGES,
+} latprobe_stage_t;
+
+typedef struct {
+    uint32_t count;
+    uint64_t sum_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t hist[LATPROBE_BUCKETS];
+} latprobe_hist_t;
+
+typedef struct {
+    uint32_t marked;
+    uint32_t answered;
+    uint32_t expired;       // Never answered, or answered too late.
+    uint32_t unsynced;      // Skipped before the clocks were synchronized.
+    latprobe_hist_t stage[LATPROBE_STAGES];
+} latprobe_stats_t;
+
+// Called with each outgoing block before it is sent. Sets the marker bit
+// (bit 15, unused by 12 bit samples) on a probed sample and returns its
+// probe id, or 0 if the block carries none.
+int latprobe_mark(uint16_t samps[], int n, int64_t capture_us, int rate);
+// Called once the marked block was handed to the transport.
+void latprobe_sent(int id);
+// Handler for the server's "latency_probe" answers.
+void latprobe_on_message(const wsmsg_t *msg);
+void latprobe_get_stats(latprobe_stats_t *stats, int reset);
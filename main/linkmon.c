@@ -0,0 +1,138 @@
+#include <string.h>
+#include <inttypes.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_wifi.h"
+
+#include "linkmon.h"
+#include "adapt.h"
+#include "packetizer.h"
+#include "udpclient.h"
+
+#define TAG "LINKMON"
+
+#ifndef CONFIG_LINKMON_PERIOD_MS
+#define CONFIG_LINKMON_PERIOD_MS 1000
+#endif
+
+// RSSI thresholds with a few dB of hysteresis between entering and leaving.
+#define RSSI_FAIR (-67)
+#define RSSI_POOR (-75)
+#define RSSI_HYST 3
+// Fraction of the previous period's datagrams that failed or were dropped.
+#define FAIL_FAIR_PERMILLE 10
+#define FAIL_POOR_PERMILLE 50
+
+// Blocks are spaced at this fraction of their playout time, which smooths
+// bursts while still letting a backlog drain. A block split over several
+// datagrams (RTP L24, long L16) is paced as one.
+#define PACE_PERCENT 80
+
+static portMUX_TYPE link_lock = portMUX_INITIALIZER_UNLOCKED;
+static linkmon_stats_t stats = { .rssi_min = 0, .quality = LINK_GOOD };
+
+static link_quality_t classify(int rssi, uint32_t fail_permille, link_quality_t prev)
+{
+    int fair = RSSI_FAIR + (prev >= LINK_FAIR ? RSSI_HYST : 0);
+    int poor = RSSI_POOR + (prev >= LINK_POOR ? RSSI_HYST : 0);
+
+    if (rssi < poor || fail_permille >= FAIL_POOR_PERMILLE) return LINK_POOR;
+    if (rssi < fair || fail_permille >= FAIL_FAIR_PERMILLE) return LINK_FAIR;
+    return LINK_GOOD;
+}
+
+static uint32_t pace_gap(void)
+{
+    return (uint64_t)packetizer_frames() * 1000000 / packetizer_rate() * PACE_PERCENT / 100;
+}
+
+void linkmon_update_pacing(void)
+{
+    uint32_t gap = pace_gap();
+
+#if CONFIG_LINKMON_PACING
+    udp_set_pacing(gap);
+#endif
+    portENTER_CRITICAL(&link_lock);
+    stats.pace_gap_us = gap;
+    portEXIT_CRITICAL(&link_lock);
+}
+
+static void linkmon_task(void *pvParameters)
+{
+    static const char *names[] = {"good", "fair", "poor"};
+    uint32_t prev_sent = 0, prev_fail = 0;
+
+    while (1) {
+        wifi_ap_record_t ap;
+        wifi_bandwidth_t bw = WIFI_BW_HT20;
+        linkmon_stats_t cur = stats;
+
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_LINKMON_PERIOD_MS));
+
+        if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) continue;
+        esp_wifi_get_bandwidth(WIFI_IF_STA, &bw);
+
+        // The driver has no public retry counters, so failures are what the
+        // stack reports back to us: send errors plus queue/pool drops. Only
+        // UDP builds have those; otherwise RSSI alone decides.
+        uint32_t sent = 0, fail = 0;
+#if CONFIG_STREAM_TRANSPORT_UDP
+        udp_tx_stats_t tx;
+        txq_stats_t q;
+
+        udp_get_tx_stats(&tx, 0);
+        udp_get_queue_stats(&q, 0);
+        sent = tx.sent;
+        fail = tx.errors + tx.dropped + q.dropped;
+#endif
+        uint32_t d_sent = sent - prev_sent;
+        uint32_t d_fail = fail - prev_fail;
+        prev_sent = sent;
+        prev_fail = fail;
+        uint32_t permille = d_sent + d_fail ? d_fail * 1000 / (d_sent + d_fail) : 0;
+
+        cur.rssi = ap.rssi;
+        if (!cur.samples || ap.rssi < cur.rssi_min) cur.rssi_min = ap.rssi;
+        cur.channel = ap.primary;
+        cur.phy = (ap.phy_11b ? LINKMON_PHY_11B : 0) | (ap.phy_11g ? LINKMON_PHY_11G : 0)
+                | (ap.phy_11n ? LINKMON_PHY_11N : 0) | (ap.phy_lr ? LINKMON_PHY_LR : 0);
+        cur.ht40 = bw == WIFI_BW_HT40;
+        cur.tx_failures = d_fail;
+        cur.samples++;
+        cur.quality = classify(ap.rssi, permille, stats.quality);
+        cur.pace_gap_us = pace_gap();
+
+#if CONFIG_LINKMON_PACING
+        udp_set_pacing(cur.pace_gap_us);
+#endif
+        if (cur.quality != stats.quality) {
+            ESP_LOGW(TAG, "Link %s: RSSI %d dBm, %" PRIu32 " tx failures", names[cur.quality],
+                     ap.rssi, d_fail);
+#if CONFIG_ADAPT_ENABLE
+            adapt_set_floor(cur.quality == LINK_POOR ? 2 : cur.quality == LINK_FAIR ? 1 : 0,
+                            names[cur.quality]);
+#endif
+        }
+
+        portENTER_CRITICAL(&link_lock);
+        stats = cur;
+        portEXIT_CRITICAL(&link_lock);
+    }
+}
+
+void linkmon_start(void)
+{
+    xTaskCreatePinnedToCore(linkmon_task, "linkmon", 3072, NULL, 2, NULL, 1);
+}
+
+void linkmon_get_stats(linkmon_stats_t *out, int reset_min)
+{
+    portENTER_CRITICAL(&link_lock);
+    *out = stats;
+    if (reset_min) stats.rssi_min = stats.rssi;
+    portEXIT_CRITICAL(&link_lock);
+}
@@ -0,0 +1,30 @@
+#include <stdint.h>
+
+typedef enum {
+    LINK_GOOD,
+    LINK_FAIR,
+    LINK_POOR,
+} link_quality_t;
+
+typedef struct {
+    int8_t rssi;
+    int8_t rssi_min;        // Lowest RSSI since the last reset.
+    uint8_t channel;
+    uint8_t phy;            // LINKMON_PHY_* bits of the associated AP.
+    uint8_t ht40;
+    link_quality_t quality;
+    uint32_t tx_failures;   // Send errors and drops in the last period.
+    uint32_t pace_gap_us;
+    uint32_t samples;
+} linkmon_stats_t;
+
+#define LINKMON_PHY_11B BIT0
+#define LINKMON_PHY_11G BIT1
+#define LINKMON_PHY_11N BIT2
+#define LINKMON_PHY_LR  BIT3
+
+void linkmon_start(void);
+// Recomputes the pacing gap right away, e.g. after the block size or rate
+// changed, rather than at the next link sample.
+void linkmon_update_pacing(void);
+void linkmon_get_stats(linkmon_stats_t *stats, int reset_min);
@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <string.h>
 
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
@@ -24,9 +25,22 @@
 #include "mcp3202.h"
 #include "network.h"
 #include "udpclient.h"
+#include "packetizer.h"
+#include "bench.h"
+#include "rtp.h"
+#include "adapt.h"
+#include "linkmon.h"
+#include "conn.h"
+#include "backlog.h"
+#include "wsmsg.h"
+#include "boottime.h"
+#include "settings.h"
+#include "timesync.h"
+#include "latprobe.h"
+#include "telemetry.h"
 
+#include "afast_writer.h"
 #include "cJSON.h"
-#include "mbedtls/base64.h"
 
 MCP_t dev;
 
@@ -35,10 +49,84 @@ MCP_t dev;
 #define LEDC_GPIO 4
 
 #define SAMPLE_RATE 30000
-#define N_SAMPLES 500
+
+#ifndef CONFIG_RTP_PAYLOAD_TYPE
+#define CONFIG_RTP_PAYLOAD_TYPE 96
+#endif
+
+// Largest sample rate divider a stream_config request can ask for.
+#define MAX_DECIMATE 4
+
+typedef enum {
+    CODEC_WS_JSON,
+    CODEC_WS_BINARY,
+    CODEC_UDP,
+    CODEC_RTP_L16,
+    CODEC_RTP_L24,
+} stream_codec_t;
+
+static const char *codec_names[] = {"ws_json", "ws_binary", "udp", "rtp_l16", "rtp_l24"};
+
+#if CONFIG_STREAM_TRANSPORT_WS_JSON
+#define STREAM_CODEC CODEC_WS_JSON
+#elif CONFIG_STREAM_TRANSPORT_WS_BINARY
+#define STREAM_CODEC CODEC_WS_BINARY
+#elif CONFIG_UDP_PAYLOAD_RTP_L24
+#define STREAM_CODEC CODEC_RTP_L24
+#elif CONFIG_UDP_PAYLOAD_RTP
+#define STREAM_CODEC CODEC_RTP_L16
+#else
+#define STREAM_CODEC CODEC_UDP
+#endif
+#define STREAM_EMIT emit_stream
+
+// UDP payload that fits a 1500 byte MTU without IP fragmentation.
+#define UDP_MTU_PAYLOAD 1472
+
+// Yield at least this often so IDLE0 can feed the task watchdog.
+#define YIELD_INTERVAL_US 15000
 
 static ledc_channel_config_t ledc_channel;
 
+// Request ids remembered while the capture task hasn't picked a request up.
+#define REQ_MAX_IDS 4
+
+// What req_pending holds.
+#define REQ_SERVER 0x01
+#define REQ_ADAPT 0x02
+
+// Sample rate divider in use, only changed by the capture task.
+static volatile int decimate = 1;
+static volatile stream_codec_t codec = STREAM_CODEC;
+static volatile int stream_port = 0;
+
+/* An audio_stream_config request from the server. The websocket task fills
+ * it in, the capture task applies it between blocks and acknowledges with
+ * what it could actually do. 0 (or -1 for the codec) leaves a setting.
+ * Requests arriving before the previous one was applied are merged into it,
+ * and every id is acknowledged. */
+typedef struct {
+    int decimate;
+    int block;
+    int frames;
+    int codec;
+    int port;
+    int ids[REQ_MAX_IDS];
+    int n_ids;
+} stream_request_t;
+
+// Level changes from the adaptation loop take the same path as requests.
+static portMUX_TYPE req_lock = portMUX_INITIALIZER_UNLOCKED;
+static stream_request_t pending_req;
+static const adapt_level_t *pending_level;
+static volatile int req_pending = 0;
+
+/* Owned by the capture task: the stream the server asked for, and the
+ * adaptation level on top of it. A level can make the stream more robust
+ * but never raises the rate above the server's choice. */
+static int server_decimate = 1, server_block = 0, server_frames = 0;
+static const adapt_level_t *adapt_level;
+
 static void init_hw(void)
 {
     ledc_timer_config_t ledc_timer = {
@@ -59,94 +147,599 @@ static void init_hw(void)
     ledc_channel_config(&ledc_channel);
 }
 
+/* Control messages are built in a static arena instead of the heap, so
+ * days of them can't fragment it, and printed straight into a websocket send
+ * slot; sending releases the whole document. */
+#define JSON_ARENA_SIZE 2048
+static uint8_t json_mem[JSON_ARENA_SIZE];
+static cJSON_Arena json_arena;
+static SemaphoreHandle_t json_lock;
+
+static void json_begin(void)
+{
+    xSemaphoreTake(json_lock, portMAX_DELAY);
+    cJSON_ArenaBegin(&json_arena);
+}
+
+static void json_send(cJSON *root, int formatted)
+{
+    txq_slot_t *slot;
+
+    if (json_arena.failures) {
+        ESP_LOGE("MAIN", "Control message doesn't fit the %d byte JSON arena", JSON_ARENA_SIZE);
+        json_arena.failures = 0;
+    }
+    else if ((slot = ws_control_begin())) {
+        slot->len = cJSON_PrintInto(root, (char *)slot->data, slot->cap, formatted);
+        if (slot->len) ws_control_commit(slot);
+        else {
+            ESP_LOGE("MAIN", "Control message doesn't fit a websocket slot");
+            ws_control_abort(slot);
+        }
+    }
+    cJSON_ArenaEnd(&json_arena);
+    cJSON_ArenaReset(&json_arena);
+    xSemaphoreGive(json_lock);
+}
+
+static void send_stream_config(int ack_id);
+
 static void init_ledfx(void)
 {
-    cJSON *root = cJSON_CreateObject();
-    cJSON *data = cJSON_CreateObject();
-    char *json = NULL;
+    cJSON *root, *data;
+
+    json_begin();
+    root = cJSON_CreateObject();
+    data = cJSON_CreateObject();
     cJSON_AddItemToObject(root, "data", data);
     cJSON_AddNumberToObject(root, "id", 1);
     cJSON_AddStringToObject(root, "client", "ESP32");
     cJSON_AddStringToObject(root, "type", "audio_stream_start");
-    json = cJSON_Print(root);
-    send_ws(json, 0);
+    json_send(root, 1);
 
     vTaskDelay(10);
 
+    send_stream_config(0);
+}
+
+// ack_id > 0 marks the message as the answer to that request id.
+static void send_stream_config(int ack_id)
+{
+    cJSON *root, *data;
+
+    json_begin();
     root = cJSON_CreateObject();
     data = cJSON_CreateObject();
-    json = NULL;
-    cJSON_AddNumberToObject(data, "sampleRate", SAMPLE_RATE);
-    cJSON_AddNumberToObject(data, "bufferSize", N_SAMPLES);
+    cJSON_AddNumberToObject(data, "sampleRate", SAMPLE_RATE / decimate);
+    cJSON_AddNumberToObject(data, "bufferSize", packetizer_frames());
+    cJSON_AddNumberToObject(data, "blockSize", packetizer_block_size());
+    cJSON_AddNumberToObject(data, "channels", 1);
     cJSON_AddNumberToObject(data, "bits", 12);
+    cJSON_AddStringToObject(data, "transport", codec_names[codec]);
+#if CONFIG_STREAM_TRANSPORT_UDP
+    cJSON_AddNumberToObject(data, "port", stream_port);
+#endif
     cJSON_AddItemToObject(root, "data", data);
+    if (ack_id) cJSON_AddNumberToObject(root, "ack", ack_id);
     cJSON_AddNumberToObject(root, "id", 1);
     cJSON_AddStringToObject(root, "client", "ESP32");
     cJSON_AddStringToObject(root, "type", "audio_stream_config");
-    json = cJSON_Print(root);
-    send_ws(json, 0);
+    json_send(root, 1);
+}
+
+static void send_ledfx_data(uint16_t samps[], int n, int64_t capture_us)
+{
+    txq_slot_t *slot = ws_send_begin();
 
-    cJSON_Delete(root);
+    if (!slot) return;
+    slot->len = afast_write((char *)slot->data, slot->cap, samps, n);
+    ws_send_commit(slot, 0);
 }
 
-static void send_ledfx_data(uint16_t samps[])
+static void send_ledfx_data_ws_bin(uint16_t samps[], int n, int64_t capture_us)
 {
-    cJSON *root = cJSON_CreateObject();
-    char *json = NULL;
+    static uint32_t seq = 0;
+    int64_t server_us = 0;
 
-    unsigned char inBuf[N_SAMPLES*2];
-    unsigned char outBuf[N_SAMPLES*3];
-    size_t outlen = N_SAMPLES*3;
+    timesync_to_server(capture_us, &server_us);
+    ws_audio_hdr_t hdr = {
+        .version = WS_AUDIO_VERSION,
+        .format = WS_AUDIO_FORMAT_U12LE,
+        .samples = n,
+        .seq = seq++,
+        .capture_us = (uint32_t)capture_us,
+        .server_us = server_us,
+    };
+
+    send_ws_bin(&hdr, sizeof(hdr), samps, n*2);
+}
 
-    for (int i = 0; i < N_SAMPLES; i++) {
-        memcpy(inBuf+i*2, (char*)&samps[i], 2);
+static void send_ledfx_data_udp(uint16_t samps[], int n, int64_t capture_us)
+{
+    // Samples are already little-endian 16 bit, which is the wire format.
+    send_udp((char *)samps, n*2);
+}
+
+static void send_ledfx_data_rtp(uint16_t samps[], int n, int64_t capture_us)
+{
+    // Static: the backlog flush task's stack can't spare an MTU, and only
+    // one task emits at a time (the backlog hands over between modes).
+    static uint8_t pkt[UDP_MTU_PAYLOAD];
+    int max = rtp_max_samples(sizeof(pkt));
+
+    // L24 blocks can exceed one MTU; split them rather than fragment.
+    for (int off = 0; off < n; off += max) {
+        int chunk = n - off < max ? n - off : max;
+        size_t len = rtp_write(pkt, sizeof(pkt), &samps[off], chunk,
+                               capture_us + (int64_t)off * 1000000 / packetizer_rate());
+        if (off) send_udp_more((char *)pkt, len);
+        else send_udp((char *)pkt, len);
     }
-    mbedtls_base64_encode(outBuf, N_SAMPLES*3, &outlen, inBuf, N_SAMPLES*2);
+}
 
-    cJSON_AddStringToObject(root, "data", (const char*)outBuf);
-    cJSON_AddNumberToObject(root, "id", 1);
-    cJSON_AddStringToObject(root, "client", "ESP32");
-    cJSON_AddStringToObject(root, "type", "afast");
-    json = cJSON_Print(root);
-    send_ws(json, 0);
-    //printf("%s\n%s\n", outBuf, json);
+static void emit_stream(uint16_t samps[], int n, int64_t capture_us)
+{
+#if CONFIG_LATPROBE_ENABLE
+    // RTP converts samples to signed PCM, which leaves no room for the marker.
+    int probe = codec <= CODEC_UDP ? latprobe_mark(samps, n, capture_us, packetizer_rate()) : 0;
+#endif
+
+    boot_mark(BOOT_FIRST_PACKET);
+    switch (codec) {
+    case CODEC_WS_JSON:
+        send_ledfx_data(samps, n, capture_us);
+        break;
+    case CODEC_WS_BINARY:
+        send_ledfx_data_ws_bin(samps, n, capture_us);
+        break;
+    case CODEC_UDP:
+        send_ledfx_data_udp(samps, n, capture_us);
+        break;
+    case CODEC_RTP_L16:
+    case CODEC_RTP_L24:
+        send_ledfx_data_rtp(samps, n, capture_us);
+        break;
+    }
+#if CONFIG_LATPROBE_ENABLE
+    latprobe_sent(probe);
+#endif
+}
+
+#if CONFIG_BACKLOG_ENABLE
+// Backlog replay holds each block until it fits; RTP may split one in two.
+static int stream_ready(void)
+{
+#if CONFIG_STREAM_TRANSPORT_UDP
+    return udp_tx_space() >= 2;
+#else
+    return ws_queue_space() >= 2;
+#endif
+}
+#endif
 
-    cJSON_Delete(root);
+// Codecs of the transport the firmware was built for; the other one has
+// no running task or negotiated port to switch to.
+static int codec_available(stream_codec_t c)
+{
+#if CONFIG_STREAM_TRANSPORT_UDP
+    return c == CODEC_UDP || c == CODEC_RTP_L16 || c == CODEC_RTP_L24;
+#else
+    return c == CODEC_WS_JSON || c == CODEC_WS_BINARY;
+#endif
 }
 
-static void send_ledfx_data_udp(uint16_t samps[])
+// RTP timestamps are in sample units, so an RTP receiver can't follow a rate
+// change it didn't ask for.
+static int codec_fixed_rate(stream_codec_t c)
 {
-    char buf[N_SAMPLES*2];
+    return c == CODEC_RTP_L16 || c == CODEC_RTP_L24;
+}
+
+#if CONFIG_ADAPT_ENABLE
+static int adapt_max_level(void)
+{
+    return codec_fixed_rate(codec) ? 1 : 2;
+}
+#endif
 
-    for (int i = 0; i < N_SAMPLES; i++) {
-        memcpy(buf+i*2, (char*)&samps[i], 2);
-        //memcpy(buf+i*2, (char*)&sineLookupTable[i], 2);
+static void start_rtp(void)
+{
+    int rate = SAMPLE_RATE / decimate;
+
+    if (codec == CODEC_RTP_L24) rtp_init(rate, CONFIG_RTP_PAYLOAD_TYPE, 3);
+    else if (codec == CODEC_RTP_L16) rtp_init(rate, CONFIG_RTP_PAYLOAD_TYPE, 2);
+}
+
+// Runs on the capture task between blocks.
+static void apply_stream_request(void)
+{
+    stream_request_t req;
+    const adapt_level_t *level;
+    int flags;
+
+    portENTER_CRITICAL(&req_lock);
+    flags = req_pending;
+    req = pending_req;
+    level = pending_level;
+    req_pending = 0;
+    portEXIT_CRITICAL(&req_lock);
+
+    if (flags & REQ_ADAPT) adapt_level = level;
+    if (flags & REQ_SERVER) {
+        if (req.decimate) server_decimate = req.decimate;
+        if (req.block) server_block = req.block;
+        if (req.frames) server_frames = req.frames;
     }
-    send_udp(buf, N_SAMPLES*2);
-    //send_udp(buf, 10);
+    else req.codec = -1;
+
+    int codec_changed = req.codec >= 0 && req.codec != codec;
+    if (codec_changed) codec = req.codec;
+
+    int d = server_decimate;
+    if (adapt_level && !codec_fixed_rate(codec) && adapt_level->decimate > d) d = adapt_level->decimate;
+    int rate_changed = d != decimate;
+
+    if ((flags & REQ_ADAPT) || req.block || req.frames) {
+        if (adapt_level && adapt_level->frames) packetizer_set_config(adapt_level->block, adapt_level->frames);
+        else {
+            packetizer_init_profile();
+            if (server_block || server_frames) {
+                int block = server_block ? server_block : packetizer_block_size();
+                int frames = server_frames ? server_frames : packetizer_frames();
+                packetizer_set_config(block - block % d, frames);
+            }
+        }
+    }
+    decimate = d;
+    packetizer_set_rate(SAMPLE_RATE / d);
+    // A new RTP clock rate or sample width starts a new RTP stream.
+    if (rate_changed || codec_changed) start_rtp();
+#if CONFIG_ADAPT_ENABLE
+    if (codec_changed) adapt_set_max_level(adapt_max_level());
+#endif
+#if CONFIG_STREAM_TRANSPORT_UDP
+    if (req.port) {
+        stream_port = req.port;
+        udp_set_port(req.port);
+    }
+#endif
+#if CONFIG_LINKMON_ENABLE
+    // Blocks may now be shorter; an old, longer gap would overrun the queue.
+    linkmon_update_pacing();
+#endif
+    if (!(flags & REQ_SERVER)) send_stream_config(0);
+    else if (!req.n_ids) send_stream_config(1);
+    for (int i = 0; i < req.n_ids; i++) send_stream_config(req.ids[i]);
+}
+
+// Called by the adaptation loop from whichever task reported; the capture
+// task applies the level between blocks.
+static void apply_adapt_level(const adapt_level_t *level)
+{
+    portENTER_CRITICAL(&req_lock);
+    pending_level = level;
+    req_pending |= REQ_ADAPT;
+    portEXIT_CRITICAL(&req_lock);
 }
 
 void main_thread() {
     unsigned int vactrol_val = DEFAULT_VACTROL_VAL;
     init_hw();
     ledc_set_duty(ledc_channel.speed_mode, ledc_channel.channel, DEFAULT_VACTROL_VAL);
+    telemetry_set_agc(vactrol_val);
+    int64_t last_yield = esp_timer_get_time();
     while(1) {
-        uint16_t samples[N_SAMPLES] = {0};
-        if (mcpReadData(&dev, 0, samples, N_SAMPLES)) {
+        uint16_t samples[PACKETIZER_MAX_FRAMES] = {0};
+        if (req_pending) apply_stream_request();
+        int d = decimate;
+        int block = packetizer_block_size();
+        block -= block % d;
+        int64_t capture_us = esp_timer_get_time();
+        if (mcpReadData(&dev, 0, samples, block)) {
             vactrol_val += 1;
             //ESP_LOGI("AG", "peak %d", vactrol_val);
             ledc_set_duty(ledc_channel.speed_mode, ledc_channel.channel, vactrol_val);
             ledc_update_duty(ledc_channel.speed_mode, ledc_channel.channel);
+            telemetry_set_agc(vactrol_val);
+        }
+        int n = block;
+        if (d > 1) {
+            n = block / d;
+            for (int i = 0; i < n; i++) {
+                unsigned int sum = 0;
+                for (int j = 0; j < d; j++) sum += samples[d*i + j];
+                samples[i] = sum / d;
+            }
+        }
+        packetizer_push(samples, n, capture_us);
+        if (esp_timer_get_time() - last_yield >= YIELD_INTERVAL_US) {
+            vTaskDelay(1);
+            last_yield = esp_timer_get_time();
+        }
+    }
+}
+
+#if CONFIG_STREAM_TRANSPORT_UDP
+static void start_udp(int udpPort)
+{
+    xTaskCreatePinnedToCore(udp_client_task,
+        "udp",
+        2048,
+        (void *)udpPort,
+        19,
+        NULL,
+        1);
+}
+#endif
+
+// UDP port from the server's answer to audio_stream_start, 0 if none yet.
+static volatile int handshake_port = 0;
+
+// Control message handlers, called on the websocket task as messages arrive.
+
+// {"connected":"true","udp_port":1234} answers audio_stream_start.
+static void on_handshake(const wsmsg_t *msg)
+{
+    const char *connected = wsmsg_get_str(msg, "connected");
+    double port;
+
+    if (!connected || strcmp(connected, "true")) {
+        ESP_LOGE("MAIN", "Json connected value wrong: %s", connected ? connected : "(missing)");
+        return;
+    }
+    if (!wsmsg_get_num(msg, "udp_port", &port) || port < 1) {
+        ESP_LOGE("MAIN", "UDP port provided was not a number.");
+        return;
+    }
+    handshake_port = (int)port;
+    conn_post(CONN_EV_HANDSHAKE);
+}
+
+// {"type":"stream_feedback","loss":0.01,"jitter_ms":3.5} from the receiver.
+static void on_feedback(const wsmsg_t *msg)
+{
+    double loss, jitter;
+
+    if (!wsmsg_get_num(msg, "loss", &loss) || !wsmsg_get_num(msg, "jitter_ms", &jitter)) {
+        ESP_LOGE("MAIN", "Malformed stream_feedback.");
+        return;
+    }
+#if CONFIG_ADAPT_ENABLE
+    adapt_feedback(loss, jitter);
+#endif
+}
+
+/* {"type":"audio_stream_config","id":7,"data":{"sampleRate":15000,
+ * "blockSize":240,"bufferSize":720,"channels":1,"transport":"rtp_l16",
+ * "port":5004}}. Every member of data is optional. Rates are rounded to
+ * the nearest divider of the ADC rate; mono 12 bit is all the hardware has,
+ * so channels and bits can only be acknowledged as 1 and 12. */
+static void on_stream_config(const wsmsg_t *msg)
+{
+    const wsmsg_field_t *data = wsmsg_get(msg, "data");
+    stream_request_t req = { .codec = -1 };
+    const char *transport;
+    int id = 0;
+    wsmsg_t cfg;
+    double v;
+
+    // Our own announcements echoed back by the server carry "client".
+    if (wsmsg_get_str(msg, "client")) return;
+    if (!data || !wsmsg_parse_raw(data, &cfg)) {
+        ESP_LOGE("MAIN", "audio_stream_config without a data object.");
+        return;
+    }
+    if (wsmsg_get_num(msg, "id", &v) && v >= 1 && v <= INT32_MAX) id = (int)v;
+    if (wsmsg_get_num(&cfg, "sampleRate", &v) && v > 0) {
+        int d = (int)(SAMPLE_RATE / v + 0.5);
+        req.decimate = d < 1 ? 1 : d > MAX_DECIMATE ? MAX_DECIMATE : d;
+    }
+    if (wsmsg_get_num(&cfg, "blockSize", &v)) req.block = (int)v;
+    if (wsmsg_get_num(&cfg, "bufferSize", &v)) req.frames = (int)v;
+    if (wsmsg_get_num(&cfg, "port", &v) && v > 0 && v < 65536) req.port = (int)v;
+    if ((transport = wsmsg_get_str(&cfg, "transport"))) {
+        for (int c = 0; c < sizeof(codec_names) / sizeof(codec_names[0]); c++)
+            if (!strcmp(transport, codec_names[c]) && codec_available(c)) req.codec = c;
+        if (req.codec < 0) ESP_LOGW("MAIN", "Transport %s not available, keeping %s", transport, codec_names[codec]);
+    }
+
+    portENTER_CRITICAL(&req_lock);
+    if (!(req_pending & REQ_SERVER)) pending_req = req;
+    else {
+        if (req.decimate) pending_req.decimate = req.decimate;
+        if (req.block) pending_req.block = req.block;
+        if (req.frames) pending_req.frames = req.frames;
+        if (req.codec >= 0) pending_req.codec = req.codec;
+        if (req.port) pending_req.port = req.port;
+    }
+    if (id && pending_req.n_ids < REQ_MAX_IDS) {
+        pending_req.ids[pending_req.n_ids++] = id;
+        id = 0;
+    }
+    req_pending |= REQ_SERVER;
+    portEXIT_CRITICAL(&req_lock);
+    if (id) ESP_LOGW("MAIN", "Too many audio_stream_config requests queued, request %d is merged but not acknowledged", id);
+}
+
+/* {"type":"device_config","id":3,"data":{"server_host":"192.168.1.20"}}
+ * Changes settings and stores them in NVS. A new server takes effect right
+ * away; Wi-Fi settings on the next boot, so a typo can't cut the link the
+ * request came over. The reply lists the active values, without secrets. */
+static void on_device_config(const wsmsg_t *msg)
+{
+    const wsmsg_field_t *data = wsmsg_get(msg, "data");
+    wsmsg_t cfg;
+    double id = 0;
+    int rejected = 0, failed, changed;
+
+    if (!data || !wsmsg_parse_raw(data, &cfg)) {
+        ESP_LOGE("MAIN", "device_config without a data object.");
+        return;
+    }
+    wsmsg_get_num(msg, "id", &id);
+
+    settings_begin();
+    for (int i = 0; i < cfg.n; i++) {
+        const wsmsg_field_t *f = &cfg.f[i];
+        setting_result_t res = SETTING_BAD_VALUE;
+        if (f->type == WSMSG_STR) res = settings_set_str(f->key, f->str);
+        // Out of range for int32_t even before the per-key range check.
+        else if (f->type == WSMSG_NUM && f->num >= INT32_MIN && f->num <= INT32_MAX)
+            res = settings_set_int(f->key, (int32_t)f->num);
+        if (res != SETTING_OK) {
+            ESP_LOGW("MAIN", "device_config: %s %s", f->key, res == SETTING_UNKNOWN ? "unknown" : "invalid");
+            rejected++;
+        }
+    }
+    changed = settings_commit(&failed);
+
+    settings_t s;
+    settings_get(&s);
+    json_begin();
+    cJSON *root = cJSON_CreateObject();
+    cJSON *out = cJSON_CreateObject();
+    cJSON_AddStringToObject(out, "wifi_ssid", s.wifi_ssid);
+    cJSON_AddNumberToObject(out, "wifi_retry", s.wifi_retry);
+    cJSON_AddStringToObject(out, "server_host", s.server_host);
+    cJSON_AddNumberToObject(out, "server_port", s.server_port);
+    cJSON_AddStringToObject(out, "ws_path", s.ws_path);
+    cJSON_AddItemToObject(root, "data", out);
+    cJSON_AddNumberToObject(root, "changed", changed);
+    cJSON_AddNumberToObject(root, "rejected", rejected);
+    // Accepted but not saved; the device keeps the old value.
+    cJSON_AddNumberToObject(root, "failed", failed);
+    if (id > 0) cJSON_AddNumberToObject(root, "ack", id);
+    cJSON_AddStringToObject(root, "client", "ESP32");
+    cJSON_AddStringToObject(root, "type", "device_config");
+    json_send(root, 0);
+
+    if (settings_changed("server_host") || settings_changed("server_port") || settings_changed("ws_path"))
+        ws_reconnect();
+}
+
+// Resend the handshake if the server hasn't answered within this long.
+#define HANDSHAKE_TIMEOUT_US 2000000
+
+/* Connection state machine, driven by Wi-Fi/websocket events and control
+ * messages. Losing either link while streaming stops the UDP task right
+ * away; the handshake is redone as soon as the websocket is back. */
+static void run_connection(void)
+{
+    static int capture_started = 0;
+    int64_t handshake_us = 0;
+    conn_event_t ev;
+
+    while (1) {
+        conn_state_t state = conn_get_state();
+        int got = conn_wait(&ev, pdMS_TO_TICKS(500));
+
+        if (got && (ev == CONN_EV_WIFI_DOWN || ev == CONN_EV_WS_DOWN)) {
+#if CONFIG_STREAM_TRANSPORT_UDP
+            if (state == CONN_STREAMING) shutdown_socket();
+#endif
+#if CONFIG_BACKLOG_ENABLE
+            backlog_set_online(0);
+#endif
+            if (ev == CONN_EV_WIFI_DOWN) conn_set_state(CONN_WIFI_WAIT);
+            else if (state != CONN_WIFI_WAIT) conn_set_state(CONN_WS_WAIT);
+            continue;
+        }
+
+        switch (state) {
+        case CONN_WIFI_WAIT:
+            if (got && ev == CONN_EV_WIFI_UP) conn_set_state(CONN_WS_WAIT);
+            // The client may reconnect before the IP event is handled.
+            if (!got || ev != CONN_EV_WS_UP) break;
+            /* fallthrough */
+        case CONN_WS_WAIT:
+            if (got && ev == CONN_EV_WS_UP) {
+                handshake_port = 0;
+                init_ledfx();
+                handshake_us = esp_timer_get_time();
+                conn_set_state(CONN_HANDSHAKE);
+            }
+            break;
+        case CONN_HANDSHAKE:
+            if (got && ev == CONN_EV_HANDSHAKE) {
+                int udpPort = handshake_port;
+                boot_mark(BOOT_HANDSHAKE);
+                stream_port = udpPort;
+                if (!capture_started) {
+                    xTaskCreatePinnedToCore(main_thread,
+                        "main_thread",
+                        4096+4096+2048,
+                        NULL,
+                        1,
+                        NULL,
+                        0);
+                    capture_started = 1;
+                }
+#if CONFIG_STREAM_TRANSPORT_UDP
+                start_udp(udpPort);
+#endif
+                conn_set_state(CONN_STREAMING);
+#if CONFIG_BACKLOG_ENABLE
+                backlog_set_online(1);
+#endif
+            }
+            else if (esp_timer_get_time() - handshake_us >= HANDSHAKE_TIMEOUT_US) {
+                ESP_LOGW("MAIN", "No answer to audio_stream_start, retrying");
+                init_ledfx();
+                handshake_us = esp_timer_get_time();
+            }
+            break;
+        case CONN_STREAMING:
+            // Control messages are handled on the websocket task as they arrive.
+            // A websocket that came back without us seeing it drop may be a
+            // different server: stop streaming and shake hands again.
+            if (got && ev == CONN_EV_WS_UP) {
+#if CONFIG_STREAM_TRANSPORT_UDP
+                shutdown_socket();
+#endif
+#if CONFIG_BACKLOG_ENABLE
+                backlog_set_online(0);
+#endif
+                handshake_port = 0;
+                init_ledfx();
+                handshake_us = esp_timer_get_time();
+                conn_set_state(CONN_HANDSHAKE);
+            }
+            break;
         }
-        send_ledfx_data_udp(samples);
-        vTaskDelay(1);
     }
 }
 
 void app_main(void)
 {
-    int udpPort = 0;
+    boot_mark(BOOT_APP_MAIN);
+    settings_init();
+    json_lock = xSemaphoreCreateMutex();
+    cJSON_ArenaInit(&json_arena, json_mem, sizeof(json_mem));
     mcpInit(&dev, MCP_SINGLE);
+    start_rtp();
+#if CONFIG_BACKLOG_ENABLE && CONFIG_BACKLOG_LIVE
+    backlog_init(STREAM_EMIT, stream_ready, CONFIG_BACKLOG_SECONDS * SAMPLE_RATE, BACKLOG_LIVE);
+    packetizer_init(backlog_emit, SAMPLE_RATE);
+#elif CONFIG_BACKLOG_ENABLE
+    backlog_init(STREAM_EMIT, stream_ready, CONFIG_BACKLOG_SECONDS * SAMPLE_RATE, BACKLOG_FLUSH);
+    packetizer_init(backlog_emit, SAMPLE_RATE);
+#else
+    packetizer_init(STREAM_EMIT, SAMPLE_RATE);
+#endif
+#if CONFIG_ADAPT_ENABLE
+    adapt_init(apply_adapt_level, adapt_max_level());
+#endif
+    conn_init();
+    wsmsg_register(NULL, on_handshake);
+    wsmsg_register("stream_feedback", on_feedback);
+    wsmsg_register("audio_stream_config", on_stream_config);
+    wsmsg_register("device_config", on_device_config);
+#if CONFIG_TIMESYNC_ENABLE
+    wsmsg_register("time_sync", timesync_on_message);
+#endif
+#if CONFIG_LATPROBE_ENABLE
+    wsmsg_register("latency_probe", latprobe_on_message);
+#endif
     init_wifi();
 
     xTaskCreatePinnedToCore(websocket_app_start,
@@ -156,57 +749,17 @@ void app_main(void)
         1,
         NULL,
         1);
-    
-    vTaskDelay(20);
-    while (!wait_for_ws());
-    vTaskDelay(20);
-    init_ledfx();
 
-    while (udpPort < 1) {
-        udpPort = msg_check();
-        vTaskDelay(100);
-    }
-    check_connection(); // Clears the disconnect sema.
-
-    xTaskCreatePinnedToCore(main_thread,
-        "main_thread",
-        4096+4096,
-        NULL,
-        1,
-        NULL,
-        0);
+#if CONFIG_TIMESYNC_ENABLE
+    timesync_start();
+#endif
+#if CONFIG_LINKMON_ENABLE
+    linkmon_start();
+#endif
+#if CONFIG_TELEMETRY_ENABLE
+    telemetry_start();
+#endif
+    bench_start();
 
-    xTaskCreatePinnedToCore(udp_client_task,
-        "udp",
-        2048,
-        (void *)udpPort,
-        19,
-        NULL,
-        1);
-    
-    while (1) {
-        vTaskDelay(2000);
-        if (check_connection()) {
-            shutdown_socket();
-            while (!wait_for_ws());
-            vTaskDelay(20);
-            init_ledfx();
-
-            udpPort = 0;
-            while (udpPort < 1) {
-                udpPort = msg_check();
-                vTaskDelay(100);
-            }
-            check_connection(); // Clears the sema.
-
-            xTaskCreatePinnedToCore(udp_client_task,
-                "udp",
-                2048,
-                (void *)udpPort,
-                19,
-                NULL,
-                1);
-        }
-    }
+    run_connection();
 }
-
@@ -1,17 +1,23 @@
+#include <string.h>
+
 #include "network.h"
 
 #include "esp_wifi.h"
 #include "nvs_flash.h"
+#include "nvs.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include <inttypes.h>
 
-#include "cJSON.h"
+#include "txqueue.h"
+#include "conn.h"
+#include "wsmsg.h"
+#include "boottime.h"
+#include "settings.h"
 
-#define EXAMPLE_ESP_WIFI_SSID      "SSID"
-#define EXAMPLE_ESP_WIFI_PASS      "PASSWORD"
-#define EXAMPLE_ESP_MAXIMUM_RETRY  10
 
 #if CONFIG_ESP_WPA3_SAE_PWE_HUNT_AND_PECK
 #define ESP_WIFI_SAE_MODE WPA3_SAE_PWE_HUNT_AND_PECK
@@ -45,13 +51,7 @@
 static EventGroupHandle_t s_wifi_event_group;
 static TimerHandle_t shutdown_signal_timer;
 static SemaphoreHandle_t shutdown_sema;
-static SemaphoreHandle_t send_sema;
-static SemaphoreHandle_t msg_sema;
-static SemaphoreHandle_t ws_start_sema;
-static SemaphoreHandle_t ws_disc_sema;
-
-
-static char bufWs[128];
+static esp_websocket_client_handle_t ws_client;
 
 /* The event group allows multiple bits for each event, but we only care about two events:
  * - we are connected to the AP with an IP
@@ -65,39 +65,162 @@ static const char *TAG = "wifi station";
 
 static int s_retry_num = 0;
 
-static char send_data[2000] = {0};
-static int len_data = 0;
+/* Reconnect delays. The first Wi-Fi retries go out immediately, later ones
+ * and all websocket retries back off exponentially with jitter so a
+ * reachable server is back within a few hundred ms while a dead one is not
+ * hammered. */
+#define WIFI_BACKOFF_BASE_MS 250
+#define WIFI_BACKOFF_MAX_MS 10000
+#define WS_BACKOFF_BASE_MS 100
+#define WS_BACKOFF_MAX_MS 5000
+
+static conn_backoff_t wifi_backoff = { WIFI_BACKOFF_BASE_MS, WIFI_BACKOFF_MAX_MS, 0 };
+static conn_backoff_t ws_backoff = { WS_BACKOFF_BASE_MS, WS_BACKOFF_MAX_MS, 0 };
+static esp_timer_handle_t wifi_retry_timer;
+
+/* Fast connect: the AP and lease of the last successful connection are kept
+ * in NVS. The next boot connects straight to that BSSID on that channel,
+ * skipping the all-channel scan, and with CONFIG_WIFI_FAST_STATIC_IP also
+ * reuses the lease instead of waiting for DHCP. The first failure falls back
+ * to a normal scan and DHCP. */
+#define WIFI_CACHE_NS "wifi_fast"
+#define WIFI_CACHE_KEY "ap"
+#define WIFI_CACHE_VERSION 1
+
+typedef struct {
+    uint8_t version;
+    uint8_t bssid[6];
+    uint8_t channel;
+    esp_netif_ip_info_t ip;
+} wifi_cache_t;
+
+static wifi_config_t s_wifi_config;
+static esp_netif_t *s_sta_netif;
+static wifi_cache_t s_cache;
+static volatile int s_fast_connecting = 0;
+
+static int wifi_cache_load(wifi_cache_t *c)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(*c);
+    esp_err_t err;
+
+    if (nvs_open(WIFI_CACHE_NS, NVS_READONLY, &nvs) != ESP_OK) return 0;
+    err = nvs_get_blob(nvs, WIFI_CACHE_KEY, c, &len);
+    nvs_close(nvs);
+    return err == ESP_OK && len == sizeof(*c) && c->version == WIFI_CACHE_VERSION;
+}
+
+// Runs on the event task after getting an IP; only writes flash on change.
+static void wifi_cache_store(const esp_netif_ip_info_t *ip)
+{
+    wifi_ap_record_t ap;
+    wifi_cache_t c;
+    nvs_handle_t nvs;
+
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) return;
+    memset(&c, 0, sizeof(c)); // Compared bytewise, padding included.
+    c.version = WIFI_CACHE_VERSION;
+    memcpy(c.bssid, ap.bssid, sizeof(c.bssid));
+    c.channel = ap.primary;
+    c.ip = *ip;
+    if (!memcmp(&c, &s_cache, sizeof(c))) return;
+
+    if (nvs_open(WIFI_CACHE_NS, NVS_READWRITE, &nvs) != ESP_OK) return;
+    if (nvs_set_blob(nvs, WIFI_CACHE_KEY, &c, sizeof(c)) == ESP_OK) nvs_commit(nvs);
+    nvs_close(nvs);
+    s_cache = c;
+    ESP_LOGI(TAG, "Cached AP " MACSTR " channel %d", MAC2STR(c.bssid), c.channel);
+}
+
+static void wifi_fast_fallback(void)
+{
+    ESP_LOGW(TAG, "Fast connect failed, falling back to scan and DHCP");
+    s_fast_connecting = 0;
+    s_wifi_config.sta.bssid_set = false;
+    s_wifi_config.sta.channel = 0;
+    s_wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config);
+#if CONFIG_WIFI_FAST_STATIC_IP
+    esp_netif_dhcpc_start(s_sta_netif);
+#endif
+}
+
+// Fits an afast message or a binary frame of the largest datagram size.
+#define WS_SLOT_SIZE 2200
+#define WS_FLAG_BIN 1
+
+static txq_t ws_q;
+
+/* Control messages (handshake, acks, replies, time sync, probe
+ * announcements) have their own small queue, drained ahead of ws_q, so
+ * audio can never evict or crowd them out. They never evict each other:
+ * a full control queue rejects the new message and says so. */
+/* esp_websocket_client's own task runs every wsmsg handler: two wsmsg_t,
+ * a settings copy, NVS writes and cJSON printing for device_config, on top
+ * of the client itself. The library default of 4 KB leaves no headroom. */
+#define WS_CLIENT_STACK 6144
+
+#define WS_CTL_SLOTS 4
+#define WS_CTL_SLOT_SIZE 1024
+static txq_t ctl_q;
 
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        boot_mark(BOOT_WIFI_ASSOC);
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < EXAMPLE_ESP_MAXIMUM_RETRY) {
+        conn_post(CONN_EV_WIFI_DOWN);
+        if (s_fast_connecting) wifi_fast_fallback();
+        settings_t cfg;
+
+        settings_get(&cfg);
+        if (s_retry_num < cfg.wifi_retry) {
             esp_wifi_connect();
             s_retry_num++;
             ESP_LOGI(TAG, "retry to connect to the AP");
         } else {
+            uint32_t delay = conn_backoff_next(&wifi_backoff);
             xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+            ESP_LOGI(TAG, "retry to connect to the AP in %" PRIu32 " ms", delay);
+            esp_timer_start_once(wifi_retry_timer, delay * 1000ULL);
         }
         ESP_LOGI(TAG,"connect to the AP fail");
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+        boot_mark(BOOT_GOT_IP);
+        s_fast_connecting = 0;
+#if CONFIG_WIFI_FAST_CONNECT
+        wifi_cache_store(&event->ip_info);
+#endif
         s_retry_num = 0;
+        conn_backoff_reset(&wifi_backoff);
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        conn_post(CONN_EV_WIFI_UP);
     }
 }
 
+static void wifi_retry(void *arg)
+{
+    esp_wifi_connect();
+}
+
 void wifi_init_sta(void)
 {
+    const esp_timer_create_args_t retry_args = { .callback = wifi_retry, .name = "wifi_retry" };
+    settings_t settings;
+
     s_wifi_event_group = xEventGroupCreate();
+    esp_timer_create(&retry_args, &wifi_retry_timer);
 
     ESP_ERROR_CHECK(esp_netif_init());
 
     ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
+    s_sta_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -115,10 +238,8 @@ void wifi_init_sta(void)
                                                         NULL,
                                                         &instance_got_ip));
 
-    wifi_config_t wifi_config = {
+    s_wifi_config = (wifi_config_t) {
         .sta = {
-            .ssid = EXAMPLE_ESP_WIFI_SSID,
-            .password = EXAMPLE_ESP_WIFI_PASS,
             /* Authmode threshold resets to WPA2 as default if password matches WPA2 standards (pasword len => 8).
              * If you want to connect the device to deprecated WEP/WPA networks, Please set the threshold value
              * to WIFI_AUTH_WEP/WIFI_AUTH_WPA_PSK and set the password with length and format matching to
@@ -129,9 +250,27 @@ void wifi_init_sta(void)
             .sae_h2e_identifier = EXAMPLE_H2E_IDENTIFIER,
         },
     };
+    settings_get(&settings);
+    strlcpy((char *)s_wifi_config.sta.ssid, settings.wifi_ssid, sizeof(s_wifi_config.sta.ssid));
+    strlcpy((char *)s_wifi_config.sta.password, settings.wifi_pass, sizeof(s_wifi_config.sta.password));
+#if CONFIG_WIFI_FAST_CONNECT
+    if (wifi_cache_load(&s_cache)) {
+        ESP_LOGI(TAG, "Fast connect to " MACSTR " on channel %d", MAC2STR(s_cache.bssid), s_cache.channel);
+        s_wifi_config.sta.bssid_set = true;
+        memcpy(s_wifi_config.sta.bssid, s_cache.bssid, sizeof(s_cache.bssid));
+        s_wifi_config.sta.channel = s_cache.channel;
+        s_wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+#if CONFIG_WIFI_FAST_STATIC_IP
+        esp_netif_dhcpc_stop(s_sta_netif);
+        esp_netif_set_ip_info(s_sta_netif, &s_cache.ip);
+#endif
+        s_fast_connecting = 1;
+    }
+#endif
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config) );
     esp_wifi_set_ps(WIFI_PS_NONE);
+    boot_mark(BOOT_WIFI_START);
     ESP_ERROR_CHECK(esp_wifi_start() );
 
     ESP_LOGI(TAG, "wifi_init_sta finished.");
@@ -147,24 +286,16 @@ void wifi_init_sta(void)
     /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
      * happened. */
     if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to ap SSID:%s password:%s",
-                 EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
+        ESP_LOGI(TAG, "connected to ap SSID:%s", settings.wifi_ssid);
     } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
-                 EXAMPLE_ESP_WIFI_SSID, EXAMPLE_ESP_WIFI_PASS);
+        ESP_LOGI(TAG, "Failed to connect to SSID:%s", settings.wifi_ssid);
     } else {
         ESP_LOGE(TAG, "UNEXPECTED EVENT");
     }
 }
 
+// NVS must already be up, see settings_init().
 void init_wifi(void) {
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-      ESP_ERROR_CHECK(nvs_flash_erase());
-      ret = nvs_flash_init();
-    }
-    ESP_ERROR_CHECK(ret);
-
     ESP_LOGI(TAG, "ESP_WIFI_MODE_STA");
     wifi_init_sta();
     esp_wifi_set_ps(WIFI_PS_NONE);
@@ -182,25 +313,24 @@ static void websocket_event_handler(void *handler_args, esp_event_base_t base, i
     switch (event_id) {
     case WEBSOCKET_EVENT_CONNECTED:
         ESP_LOGI(TAG, "WEBSOCKET_EVENT_CONNECTED");
-        xSemaphoreGive(ws_start_sema);
+        boot_mark(BOOT_WS_CONNECTED);
+        conn_backoff_reset(&ws_backoff);
+        esp_websocket_client_set_reconnect_timeout(ws_client, WS_BACKOFF_BASE_MS);
+        conn_post(CONN_EV_WS_UP);
         break;
     case WEBSOCKET_EVENT_DISCONNECTED:
+        // Also raised for every failed connection attempt.
         ESP_LOGI(TAG, "WEBSOCKET_EVENT_DISCONNECTED");
-        xSemaphoreGive(ws_disc_sema);
+        esp_websocket_client_set_reconnect_timeout(ws_client, conn_backoff_next(&ws_backoff));
+        conn_post(CONN_EV_WS_DOWN);
         break;
     case WEBSOCKET_EVENT_DATA:
-        ESP_LOGI(TAG, "WEBSOCKET_EVENT_DATA");
-        ESP_LOGI(TAG, "Received opcode=%d", data->op_code);
         if (data->op_code == 0x08 && data->data_len == 2) {
             ESP_LOGW(TAG, "Received closed message with code=%d", 256*data->data_ptr[0] + data->data_ptr[1]);
-        } else if (data->op_code == 0x01) {
-            snprintf(bufWs, data->data_len+1, (char *)data->data_ptr);
-            ESP_LOGW(TAG, "Received=%s", bufWs);
-            xSemaphoreGive(msg_sema);
+        } else {
+            wsmsg_feed(data->op_code, data->data_ptr, data->data_len, data->payload_len,
+                       data->payload_offset, data->fin);
         }
-        ESP_LOGW(TAG, "Total payload length=%d, data_len=%d, current payload offset=%d\r\n", data->payload_len, data->data_len, data->payload_offset);
-
-        //xTimerReset(shutdown_signal_timer, portMAX_DELAY);
         break;
     case WEBSOCKET_EVENT_ERROR:
         ESP_LOGI(TAG, "WEBSOCKET_EVENT_ERROR");
@@ -209,61 +339,53 @@ static void websocket_event_handler(void *handler_args, esp_event_base_t base, i
 }
 
 void send_ws(char *dat, int len) {
-    len_data = sprintf(send_data, "%s", dat);
-    xSemaphoreGive(send_sema);
+    if (!txq_push(&ctl_q, NULL, 0, dat, strlen(dat), 0)) {
+        ESP_LOGE(TAG, "Control queue full, message dropped");
+        return;
+    }
+    txq_wake(&ws_q);
 }
 
-int msg_check() {
-    if (xSemaphoreTake(msg_sema, 0) == pdTRUE) {
-        const char *connectedVal = "true";
-        cJSON *json = cJSON_Parse(bufWs);
-        const cJSON *connected = NULL;
-        const cJSON *udpPort = NULL;
-
-        ESP_LOGI(TAG, "MSG received");
-
-        connected = cJSON_GetObjectItemCaseSensitive(json, "connected");
-        udpPort = cJSON_GetObjectItemCaseSensitive(json, "udp_port");
-        if (cJSON_IsString(connected) && (connected->valuestring != NULL)) {
-            if (strcmp(connected->valuestring, connectedVal)) {
-                ESP_LOGE(TAG, "Json connected value wrong: %s", connected->valuestring);
-                cJSON_Delete(json);
-                return -1;
-            }
-        }
-        else {
-            ESP_LOGE(TAG, "Json connected value wrong.");
-            cJSON_Delete(json);
-            return -1;
-        }
+void send_ws_bin(const void *hdr, int hdr_len, const void *dat, int len) {
+    txq_push(&ws_q, hdr, hdr_len, dat, len, WS_FLAG_BIN);
+}
 
-        if (!cJSON_IsNumber(udpPort)) {
-            ESP_LOGE(TAG, "UDP port provided was not a number.");
-            cJSON_Delete(json);
-            return -1;
-        }
-        else {
-            cJSON_Delete(json);
-            return udpPort->valueint;
-        }
-        cJSON_Delete(json);
-        //if (!strcmp(bufWs, agc)) return 1;
-    }
-    return 0;
+txq_slot_t *ws_send_begin(void) {
+    return txq_acquire(&ws_q);
 }
 
-int wait_for_ws(void)
-{
-    if (xSemaphoreTake(ws_start_sema, portMAX_DELAY) == pdTRUE)
-        return 1;
-    return 0;
+void ws_send_commit(txq_slot_t *slot, int bin) {
+    slot->flags = bin ? WS_FLAG_BIN : 0;
+    txq_commit(&ws_q, slot);
 }
 
-int check_connection(void)
-{
-    if (xSemaphoreTake(ws_disc_sema, 0) == pdTRUE)
-        return 1;
-    return 0;
+void ws_send_abort(txq_slot_t *slot) {
+    txq_abort(&ws_q, slot);
+}
+
+txq_slot_t *ws_control_begin(void) {
+    txq_slot_t *slot = txq_acquire(&ctl_q);
+
+    if (!slot) ESP_LOGE(TAG, "Control queue full, message dropped");
+    return slot;
+}
+
+void ws_control_commit(txq_slot_t *slot) {
+    txq_commit(&ctl_q, slot);
+    // The sender waits on ws_q; nudge it to look at the control queue.
+    txq_wake(&ws_q);
+}
+
+void ws_control_abort(txq_slot_t *slot) {
+    txq_abort(&ctl_q, slot);
+}
+
+void ws_get_queue_stats(txq_stats_t *stats, int reset) {
+    txq_get_stats(&ws_q, stats, reset);
+}
+
+int ws_queue_space(void) {
+    return txq_space(&ws_q);
 }
 
 void shutdown_ws(void) 
@@ -271,6 +393,63 @@ void shutdown_ws(void)
     xSemaphoreGive(shutdown_sema);
 }
 
+static char ws_uri[128];
+static volatile int ws_restart = 0;
+
+static void build_ws_uri(void)
+{
+    settings_t cfg;
+
+    settings_get(&cfg);
+    snprintf(ws_uri, sizeof(ws_uri), "ws://%s:%" PRId32 "%s", cfg.server_host, cfg.server_port, cfg.ws_path);
+}
+
+void ws_reconnect(void)
+{
+    ws_restart = 1;
+}
+
+static void ws_send_slot(esp_websocket_client_handle_t client, txq_t *q, txq_slot_t *slot)
+{
+    int sent = -1;
+
+    if (esp_websocket_client_is_connected(client)) {
+        //ESP_LOGI(TAG, "Sending WS data");
+        if (slot->flags & WS_FLAG_BIN)
+            sent = esp_websocket_client_send_bin(client, (char *)slot->data, slot->len, portMAX_DELAY);
+        else
+            sent = esp_websocket_client_send_text(client, (char *)slot->data, slot->len, portMAX_DELAY);
+    }
+    txq_release(q, slot, sent >= 0);
+}
+
+static void ws_send_control(esp_websocket_client_handle_t client)
+{
+    txq_slot_t *slot;
+
+    while ((slot = txq_receive(&ctl_q, 0))) ws_send_slot(client, &ctl_q, slot);
+}
+
+// Reconnects to the server currently in the settings. Whatever is queued
+// (e.g. the reply to the request that moved us) goes to the old one first.
+static void ws_restart_client(esp_websocket_client_handle_t client)
+{
+    txq_slot_t *slot;
+
+    ws_restart = 0;
+    ws_send_control(client);
+    for (int i = 0; i < CONFIG_TXQ_WS_SLOTS && (slot = txq_receive(&ws_q, 0)); i++)
+        ws_send_slot(client, &ws_q, slot);
+    // Stopping the client raises no disconnect event; without this the state
+    // machine would stay streaming to the old server.
+    conn_post(CONN_EV_WS_DOWN);
+    esp_websocket_client_stop(client);
+    build_ws_uri();
+    ESP_LOGI(TAG, "Reconnecting to %s...", ws_uri);
+    esp_websocket_client_set_uri(client, ws_uri);
+    esp_websocket_client_start(client);
+}
+
 void websocket_app_start(void *pvParameters)
 {
     esp_websocket_client_config_t websocket_cfg = {};
@@ -278,17 +457,21 @@ void websocket_app_start(void *pvParameters)
     shutdown_signal_timer = xTimerCreate("Websocket shutdown timer", NO_DATA_TIMEOUT_SEC * 1000 / portTICK_PERIOD_MS,
                                          pdFALSE, NULL, shutdown_signaler);
     shutdown_sema = xSemaphoreCreateBinary();
-    send_sema = xSemaphoreCreateBinary();
-    msg_sema = xSemaphoreCreateBinary();
-    ws_start_sema = xSemaphoreCreateBinary();
-    ws_disc_sema = xSemaphoreCreateBinary();
+    if (!ws_q.free_q)
+        txq_init(&ws_q, "ws", CONFIG_TXQ_WS_SLOTS, WS_SLOT_SIZE, TXQ_DEFAULT_POLICY);
+    if (!ctl_q.free_q)
+        txq_init(&ctl_q, "ws_ctl", WS_CTL_SLOTS, WS_CTL_SLOT_SIZE, TXQ_DROP_NEWEST);
 
-    websocket_cfg.uri = "ws://192.168.179.11:8888/api/websocket";
+    build_ws_uri();
+    websocket_cfg.uri = ws_uri;
+    websocket_cfg.reconnect_timeout_ms = WS_BACKOFF_BASE_MS;
+    websocket_cfg.task_stack = WS_CLIENT_STACK;
 
     ESP_LOGI(TAG, "Connecting to %s...", websocket_cfg.uri);
 
     ESP_LOGI(TAG, "Starting event register");
     esp_websocket_client_handle_t client = esp_websocket_client_init(&websocket_cfg);
+    ws_client = client;
     esp_websocket_register_events(client, WEBSOCKET_EVENT_ANY, websocket_event_handler, (void *)client);
 
     ESP_LOGI(TAG, "Starting client");
@@ -298,12 +481,10 @@ void websocket_app_start(void *pvParameters)
     //xTimerStart(shutdown_signal_timer, portMAX_DELAY);
     ESP_LOGI(TAG, "Entering loop");
     while (1) {
-        if (xSemaphoreTake(send_sema, 100) == pdTRUE) {
-            if (esp_websocket_client_is_connected(client)) {
-                //ESP_LOGI(TAG, "Sending WS data");
-                esp_websocket_client_send_text(client, send_data, len_data, portMAX_DELAY);
-            }
-        }
+        ws_send_control(client);
+        txq_slot_t *slot = txq_receive(&ws_q, 100);
+        if (slot) ws_send_slot(client, &ws_q, slot);
+        if (ws_restart) ws_restart_client(client);
         //else break;
         if (xSemaphoreTake(shutdown_sema, 0) == pdTRUE) {
             break;
@@ -2,12 +2,36 @@
 #include "freertos/event_groups.h"
 #include "freertos/semphr.h"
 #include "esp_websocket_client.h"
+#include "txqueue.h"
+
+#define WS_AUDIO_VERSION 2
+#define WS_AUDIO_FORMAT_U12LE 1 // 12 bit unsigned samples in 16 bit little-endian words
+
+// Prefix of every binary websocket audio frame, followed by the samples.
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    uint8_t format;
+    uint16_t samples;
+    uint32_t seq;
+    uint32_t capture_us;
+    int64_t server_us;  // Capture time on the server clock, 0 until synced.
+} ws_audio_hdr_t;
 
 void wifi_init_sta(void);
 void init_wifi(void);
 void websocket_app_start(void *pvParameters);
+// Control messages: queued apart from audio and sent ahead of it.
 void send_ws(char *dat, int len);
-int wait_for_ws(void);
-int check_connection(void);
+txq_slot_t *ws_control_begin(void);
+void ws_control_commit(txq_slot_t *slot);
+void ws_control_abort(txq_slot_t *slot);
+// Audio and telemetry frames: subject to the transmit queue's drop policy.
+void send_ws_bin(const void *hdr, int hdr_len, const void *dat, int len);
+txq_slot_t *ws_send_begin(void);
+void ws_send_commit(txq_slot_t *slot, int bin);
+void ws_send_abort(txq_slot_t *slot);
+void ws_get_queue_stats(txq_stats_t *stats, int reset);
+int ws_queue_space(void);
 void shutdown_ws(void);
-int msg_check();
\ No newline at end of file
+// Reconnects the websocket to the server in the current settings.
+void ws_reconnect(void);
@@ -0,0 +1,172 @@
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "packetizer.h"
+
+#define TAG "PACKETIZER"
+
+static portMUX_TYPE pkt_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static packetizer_emit_t emit_cb;
+static int sample_rate;
+static uint16_t frame_buf[PACKETIZER_MAX_FRAMES];
+static int frame_fill = 0;
+static int64_t frame_start_us = 0;
+
+static int block_size = 500;
+static int frames = 500;
+
+// Written by any task, picked up by the capture task between blocks.
+static volatile int pending_block = 0;
+static volatile int pending_frames = 0;
+
+static packetizer_stats_t stats;
+
+static int clamp_frames(int n)
+{
+    if (n < PACKETIZER_MIN_FRAMES) return PACKETIZER_MIN_FRAMES;
+    if (n > PACKETIZER_MAX_FRAMES) return PACKETIZER_MAX_FRAMES;
+    return n;
+}
+
+void packetizer_init(packetizer_emit_t emit, int rate)
+{
+    emit_cb = emit;
+    sample_rate = rate;
+    frame_fill = 0;
+    memset(&stats, 0, sizeof(stats));
+    packetizer_init_profile();
+    block_size = pending_block;
+    frames = pending_frames;
+    pending_block = 0;
+    pending_frames = 0;
+}
+
+void packetizer_init_profile(void)
+{
+#if CONFIG_STREAM_PROFILE_LOW_LATENCY
+    packetizer_set_profile(STREAM_PROFILE_LOW_LATENCY);
+#elif CONFIG_STREAM_PROFILE_HIGH_EFFICIENCY
+    packetizer_set_profile(STREAM_PROFILE_HIGH_EFFICIENCY);
+#elif CONFIG_STREAM_PROFILE_CUSTOM
+    packetizer_set_config(CONFIG_STREAM_BLOCK_SAMPLES, CONFIG_STREAM_FRAMES_PER_DATAGRAM);
+#else
+    packetizer_set_profile(STREAM_PROFILE_BALANCED);
+#endif
+}
+
+void packetizer_set_rate(int rate)
+{
+    sample_rate = rate;
+}
+
+void packetizer_set_profile(stream_profile_t profile)
+{
+    switch (profile) {
+    case STREAM_PROFILE_LOW_LATENCY:
+        packetizer_set_config(64, 64);
+        break;
+    case STREAM_PROFILE_HIGH_EFFICIENCY:
+        // Three capture blocks batched into one near-MTU datagram.
+        packetizer_set_config(240, 720);
+        break;
+    case STREAM_PROFILE_BALANCED:
+    default:
+        packetizer_set_config(500, 500);
+        break;
+    }
+}
+
+void packetizer_set_config(int block, int n)
+{
+    portENTER_CRITICAL(&pkt_lock);
+    pending_block = clamp_frames(block);
+    pending_frames = clamp_frames(n);
+    portEXIT_CRITICAL(&pkt_lock);
+}
+
+int packetizer_block_size(void)
+{
+    return pending_block ? pending_block : block_size;
+}
+
+int packetizer_frames(void)
+{
+    return pending_frames ? pending_frames : frames;
+}
+
+int packetizer_rate(void)
+{
+    return sample_rate;
+}
+
+static void emit_frame(void)
+{
+    int64_t start = esp_timer_get_time();
+    emit_cb(frame_buf, frame_fill, frame_start_us);
+    int64_t end = esp_timer_get_time();
+
+    uint32_t latency = (uint32_t)(start - frame_start_us);
+    uint32_t emit_time = (uint32_t)(end - start);
+
+    portENTER_CRITICAL(&pkt_lock);
+    stats.datagrams++;
+    stats.samples += frame_fill;
+    stats.latency_sum_us += latency;
+    if (latency > stats.latency_max_us) stats.latency_max_us = latency;
+    stats.emit_sum_us += emit_time;
+    if (emit_time > stats.emit_max_us) stats.emit_max_us = emit_time;
+    portEXIT_CRITICAL(&pkt_lock);
+
+    frame_fill = 0;
+}
+
+static void apply_pending(void)
+{
+    int new_block, new_frames;
+
+    portENTER_CRITICAL(&pkt_lock);
+    new_block = pending_block;
+    new_frames = pending_frames;
+    pending_block = 0;
+    pending_frames = 0;
+    portEXIT_CRITICAL(&pkt_lock);
+
+    if (!new_frames) return;
+    // Don't hold a partial datagram across a size change.
+    if (frame_fill) emit_frame();
+    block_size = new_block;
+    frames = new_frames;
+    ESP_LOGI(TAG, "Block %d samples, %d samples per datagram", block_size, frames);
+}
+
+void packetizer_push(uint16_t samps[], int n, int64_t capture_us)
+{
+    int off = 0;
+
+    if (pending_frames) apply_pending();
+
+    while (off < n) {
+        int chunk = frames - frame_fill;
+        if (chunk > n - off) chunk = n - off;
+        if (frame_fill == 0)
+            frame_start_us = capture_us + (int64_t)off * 1000000 / sample_rate;
+        memcpy(&frame_buf[frame_fill], &samps[off], chunk * sizeof(uint16_t));
+        frame_fill += chunk;
+        off += chunk;
+        if (frame_fill == frames) emit_frame();
+    }
+}
+
+void packetizer_get_stats(packetizer_stats_t *out, int reset)
+{
+    portENTER_CRITICAL(&pkt_lock);
+    *out = stats;
+    if (reset) memset(&stats, 0, sizeof(stats));
+    portEXIT_CRITICAL(&pkt_lock);
+}
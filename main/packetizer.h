@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Largest datagram payload that still fits a single 1500 byte MTU frame
+ * (1472 bytes of UDP payload) at 16 bits per sample. */
+#define PACKETIZER_MAX_FRAMES 736
+#define PACKETIZER_MIN_FRAMES 16
+
+typedef enum {
+    STREAM_PROFILE_LOW_LATENCY,
+    STREAM_PROFILE_BALANCED,
+    STREAM_PROFILE_HIGH_EFFICIENCY,
+} stream_profile_t;
+
+typedef struct {
+    uint32_t datagrams;
+    uint32_t samples;
+    uint64_t latency_sum_us;  // First sample captured -> datagram handed off.
+    uint32_t latency_max_us;
+    uint64_t emit_sum_us;     // Time spent in the emit callback.
+    uint32_t emit_max_us;
+} packetizer_stats_t;
+
+// capture_us is the esp_timer time at which the first sample was captured.
+typedef void (*packetizer_emit_t)(uint16_t samps[], int n, int64_t capture_us);
+
+void packetizer_init(packetizer_emit_t emit, int rate);
+void packetizer_init_profile(void);
+void packetizer_set_profile(stream_profile_t profile);
+void packetizer_set_rate(int rate);
+void packetizer_set_config(int block, int frames);
+int packetizer_block_size(void);
+int packetizer_frames(void);
+int packetizer_rate(void);
+void packetizer_push(uint16_t samps[], int n, int64_t capture_us);
+void packetizer_get_stats(packetizer_stats_t *stats, int reset);
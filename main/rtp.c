@@ -0,0 +1,167 @@
+#include <string.h>
+#include <sys/time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+
+#include "rtp.h"
+#include "timesync.h"
+
+#define RTP_VERSION 2
+#define RTCP_PT_SR 200
+#define RTCP_PT_SDES 202
+#define RTCP_SDES_CNAME 1
+#define RTCP_CNAME "ledfx-esp32"
+
+// Seconds from the NTP epoch (1900) to the Unix epoch (1970).
+#define NTP_UNIX_OFFSET 2208988800UL
+
+static portMUX_TYPE rtp_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int rate;
+static uint8_t pt;
+static int sample_bytes;
+static uint32_t ssrc;
+static uint16_t seq;
+static uint32_t ts;
+static int first = 1;
+
+// Sender report state, written by the capture task and read by the UDP task.
+static uint32_t packet_count;
+static uint32_t octet_count;
+static uint32_t last_ts;
+static int64_t last_capture_us;
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void rtp_init(int sample_rate, int payload_type, int bytes_per_sample)
+{
+    rate = sample_rate;
+    pt = payload_type & 0x7F;
+    sample_bytes = bytes_per_sample;
+    ssrc = esp_random();
+    seq = esp_random();
+    ts = esp_random();
+    first = 1;
+    packet_count = 0;
+    octet_count = 0;
+}
+
+int rtp_max_samples(size_t mtu_payload)
+{
+    return (mtu_payload - RTP_HDR_LEN) / sample_bytes;
+}
+
+size_t rtp_write(uint8_t *out, size_t cap, const uint16_t samps[], int n, int64_t capture_us)
+{
+    size_t len = RTP_HDR_LEN + n * sample_bytes;
+    uint8_t *p = out + RTP_HDR_LEN;
+
+    if (len > cap) return 0;
+
+    // V=2, no padding/extension/CSRC. Marker flags the start of a talkspurt.
+    out[0] = RTP_VERSION << 6;
+    out[1] = (first ? 0x80 : 0) | pt;
+    put_be16(out + 2, seq);
+    put_be32(out + 4, ts);
+    put_be32(out + 8, ssrc);
+
+    // 12 bit unsigned ADC codes to signed, left aligned, network byte order.
+    if (sample_bytes == 3) {
+        for (int i = 0; i < n; i++, p += 3) {
+            int32_t v = ((int32_t)samps[i] - 2048) * 4096;
+            p[0] = v >> 16;
+            p[1] = v >> 8;
+            p[2] = v;
+        }
+    }
+    else {
+        for (int i = 0; i < n; i++, p += 2) {
+            int16_t v = ((int16_t)samps[i] - 2048) * 16;
+            p[0] = (uint16_t)v >> 8;
+            p[1] = v;
+        }
+    }
+
+    portENTER_CRITICAL(&rtp_lock);
+    last_ts = ts;
+    last_capture_us = capture_us;
+    packet_count++;
+    octet_count += n * sample_bytes;
+    portEXIT_CRITICAL(&rtp_lock);
+
+    seq++;
+    ts += n;
+    first = 0;
+    return len;
+}
+
+size_t rtcp_write_sr(uint8_t *out, size_t cap)
+{
+    const size_t sr_len = 28;
+    const size_t cname_len = sizeof(RTCP_CNAME) - 1;
+    // SDES: header, SSRC, CNAME item, end marker, padded to 32 bits.
+    const size_t sdes_len = (8 + 2 + cname_len + 1 + 3) & ~3;
+    uint32_t pkts, octets, base_ts;
+    int64_t base_us;
+    struct timeval tv;
+
+    if (sr_len + sdes_len > cap || !packet_count) return 0;
+
+    portENTER_CRITICAL(&rtp_lock);
+    pkts = packet_count;
+    octets = octet_count;
+    base_ts = last_ts;
+    base_us = last_capture_us;
+    portEXIT_CRITICAL(&rtp_lock);
+
+    // Map the wallclock "now" onto the RTP timeline of the last packet. Once
+    // synced the wallclock is the server's, so receivers can line up streams
+    // from several devices.
+    int64_t now_us = esp_timer_get_time();
+    int64_t wall_us;
+    if (!timesync_to_server(now_us, &wall_us)) {
+        gettimeofday(&tv, NULL);
+        wall_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+    tv.tv_sec = wall_us / 1000000;
+    tv.tv_usec = wall_us % 1000000;
+    uint32_t now_ts = base_ts + (uint32_t)((now_us - base_us) * rate / 1000000);
+    uint32_t ntp_sec = (uint32_t)tv.tv_sec + NTP_UNIX_OFFSET;
+    uint32_t ntp_frac = (uint32_t)(((uint64_t)tv.tv_usec << 32) / 1000000);
+
+    out[0] = RTP_VERSION << 6;
+    out[1] = RTCP_PT_SR;
+    put_be16(out + 2, sr_len / 4 - 1);
+    put_be32(out + 4, ssrc);
+    put_be32(out + 8, ntp_sec);
+    put_be32(out + 12, ntp_frac);
+    put_be32(out + 16, now_ts);
+    put_be32(out + 20, pkts);
+    put_be32(out + 24, octets);
+
+    uint8_t *p = out + sr_len;
+    memset(p, 0, sdes_len);
+    p[0] = (RTP_VERSION << 6) | 1;
+    p[1] = RTCP_PT_SDES;
+    put_be16(p + 2, sdes_len / 4 - 1);
+    put_be32(p + 4, ssrc);
+    p[8] = RTCP_SDES_CNAME;
+    p[9] = cname_len;
+    memcpy(p + 10, RTCP_CNAME, cname_len);
+
+    return sr_len + sdes_len;
+}
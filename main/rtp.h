@@ -0,0 +1,9 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#define RTP_HDR_LEN 12
+
+void rtp_init(int sample_rate, int payload_type, int bytes_per_sample);
+int rtp_max_samples(size_t mtu_payload);
+size_t rtp_write(uint8_t *out, size_t cap, const uint16_t samps[], int n, int64_t capture_us);
+size_t rtcp_write_sr(uint8_t *out, size_t cap);
@@ -0,0 +1,211 @@
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+
+#include "settings.h"
+
+#define TAG "SETTINGS"
+#define SETTINGS_NS "settings"
+
+#ifndef CONFIG_LEDFX_SERVER_HOST
+#define CONFIG_LEDFX_SERVER_HOST "192.168.179.11"
+#endif
+#ifndef CONFIG_LEDFX_SERVER_PORT
+#define CONFIG_LEDFX_SERVER_PORT 8888
+#endif
+#ifndef CONFIG_LEDFX_WS_PATH
+#define CONFIG_LEDFX_WS_PATH "/api/websocket"
+#endif
+
+typedef enum {
+    TYPE_STR,
+    TYPE_INT,
+} setting_type_t;
+
+// Keys double as NVS keys, so at most 15 characters.
+typedef struct {
+    const char *key;
+    setting_type_t type;
+    size_t offset;
+    size_t size;        // STR: buffer size.
+    int32_t min, max;   // INT: accepted range.
+} setting_desc_t;
+
+#define STR_SETTING(name) { #name, TYPE_STR, offsetof(settings_t, name), sizeof(((settings_t *)0)->name), 0, 0 }
+#define INT_SETTING(name, lo, hi) { #name, TYPE_INT, offsetof(settings_t, name), sizeof(int32_t), lo, hi }
+
+static const setting_desc_t descs[] = {
+    STR_SETTING(wifi_ssid),
+    STR_SETTING(wifi_pass),
+    INT_SETTING(wifi_retry, 0, 100),
+    STR_SETTING(server_host),
+    INT_SETTING(server_port, 1, 65535),
+    STR_SETTING(ws_path),
+};
+#define N_SETTINGS (sizeof(descs) / sizeof(descs[0]))
+
+static const settings_t defaults = {
+    .wifi_ssid = CONFIG_ESP_WIFI_SSID,
+    .wifi_pass = CONFIG_ESP_WIFI_PASSWORD,
+    .wifi_retry = CONFIG_ESP_MAXIMUM_RETRY,
+    .server_host = CONFIG_LEDFX_SERVER_HOST,
+    .server_port = CONFIG_LEDFX_SERVER_PORT,
+    .ws_path = CONFIG_LEDFX_WS_PATH,
+};
+
+/* The active settings and the draft an update works on. Readers copy the
+ * active ones out under settings_lock, which a commit holds while copying the
+ * draft in, so a reader sees either the old or the new settings in full. */
+static portMUX_TYPE settings_lock = portMUX_INITIALIZER_UNLOCKED;
+static settings_t active;
+static settings_t draft;
+static uint32_t dirty, last_changed;
+
+static const setting_desc_t *find(const char *key)
+{
+    for (int i = 0; i < N_SETTINGS; i++)
+        if (!strcmp(descs[i].key, key)) return &descs[i];
+    return NULL;
+}
+
+void settings_init(void)
+{
+    settings_t *s = &draft;
+    nvs_handle_t nvs;
+    int overrides = 0;
+
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
+
+    *s = defaults;
+    if (nvs_open(SETTINGS_NS, NVS_READONLY, &nvs) == ESP_OK) {
+        for (int i = 0; i < N_SETTINGS; i++) {
+            const setting_desc_t *d = &descs[i];
+            char *field = (char *)s + d->offset;
+            size_t len = d->size;
+            esp_err_t err;
+
+            if (d->type == TYPE_STR) err = nvs_get_str(nvs, d->key, field, &len);
+            else err = nvs_get_i32(nvs, d->key, (int32_t *)field);
+            if (err == ESP_OK) overrides++;
+        }
+        nvs_close(nvs);
+    }
+    portENTER_CRITICAL(&settings_lock);
+    active = *s;
+    portEXIT_CRITICAL(&settings_lock);
+    ESP_LOGI(TAG, "Server %s:%" PRId32 "%s, SSID %s, %d values from NVS",
+             s->server_host, s->server_port, s->ws_path, s->wifi_ssid, overrides);
+}
+
+void settings_get(settings_t *out)
+{
+    portENTER_CRITICAL(&settings_lock);
+    *out = active;
+    portEXIT_CRITICAL(&settings_lock);
+}
+
+void settings_begin(void)
+{
+    settings_get(&draft);
+    dirty = 0;
+}
+
+setting_result_t settings_set_str(const char *key, const char *value)
+{
+    const setting_desc_t *d = find(key);
+
+    if (!d) return SETTING_UNKNOWN;
+    if (d->type != TYPE_STR || strlen(value) >= d->size) return SETTING_BAD_VALUE;
+    char *field = (char *)&draft + d->offset;
+    if (strcmp(field, value)) {
+        strcpy(field, value);
+        dirty |= 1u << (d - descs);
+    }
+    return SETTING_OK;
+}
+
+setting_result_t settings_set_int(const char *key, int32_t value)
+{
+    const setting_desc_t *d = find(key);
+
+    if (!d) return SETTING_UNKNOWN;
+    if (d->type != TYPE_INT || value < d->min || value > d->max) return SETTING_BAD_VALUE;
+    int32_t *field = (int32_t *)((char *)&draft + d->offset);
+    if (*field != value) {
+        *field = value;
+        dirty |= 1u << (d - descs);
+    }
+    return SETTING_OK;
+}
+
+int settings_commit(int *failed)
+{
+    nvs_handle_t nvs;
+    uint32_t stored = 0;
+    esp_err_t err;
+    int n = 0, nfailed = 0;
+
+    last_changed = 0;
+    if (failed) *failed = 0;
+    if (!dirty) return 0;
+    err = nvs_open(SETTINGS_NS, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        for (int i = 0; i < N_SETTINGS; i++) {
+            const setting_desc_t *d = &descs[i];
+            const char *field = (const char *)&draft + d->offset;
+
+            if (!(dirty & 1u << i)) continue;
+            if (d->type == TYPE_STR) err = nvs_set_str(nvs, d->key, field);
+            else err = nvs_set_i32(nvs, d->key, *(const int32_t *)field);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "Unable to store %s: %s", d->key, esp_err_to_name(err));
+                continue;
+            }
+            stored |= 1u << i;
+        }
+        err = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to save settings: %s", esp_err_to_name(err));
+        stored = 0;
+    }
+
+    // Keys that didn't reach flash keep their active value.
+    for (int i = 0; i < N_SETTINGS; i++) {
+        const setting_desc_t *d = &descs[i];
+
+        if (!(dirty & 1u << i)) continue;
+        if (stored & 1u << i) {
+            ESP_LOGI(TAG, "%s updated", d->key);
+            n++;
+        } else {
+            memcpy((char *)&draft + d->offset, (const char *)&active + d->offset, d->size);
+            nfailed++;
+        }
+    }
+    portENTER_CRITICAL(&settings_lock);
+    active = draft;
+    portEXIT_CRITICAL(&settings_lock);
+    last_changed = stored;
+    if (failed) *failed = nfailed;
+    return n;
+}
+
+int settings_changed(const char *key)
+{
+    const setting_desc_t *d = find(key);
+
+    return d && (last_changed & 1u << (d - descs));
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+// Runtime configuration: Kconfig defaults overridden by values stored in NVS.
+typedef struct {
+    char wifi_ssid[33];
+    char wifi_pass[65];
+    int32_t wifi_retry;
+    char server_host[64];
+    int32_t server_port;
+    char ws_path[32];
+} settings_t;
+
+typedef enum {
+    SETTING_OK,
+    SETTING_UNKNOWN,
+    SETTING_BAD_VALUE,
+} setting_result_t;
+
+// Loads defaults and NVS overrides. Initialises NVS flash, so call it first.
+void settings_init(void);
+// Copies the active settings; a commit on another task can't tear the copy.
+void settings_get(settings_t *out);
+
+/* Updates: settings_begin() starts from the active values, settings_set_*()
+ * change keys in that draft and settings_commit() stores the changed keys in
+ * NVS and copies the draft over the active settings. Only one task may update
+ * at a time. */
+void settings_begin(void);
+setting_result_t settings_set_str(const char *key, const char *value);
+setting_result_t settings_set_int(const char *key, int32_t value);
+/* Returns the number of keys that changed. Keys NVS failed to store keep their
+ * active value and are counted in *failed (may be NULL). */
+int settings_commit(int *failed);
+int settings_changed(const char *key);
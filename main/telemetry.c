@@ -0,0 +1,283 @@
+#include <string.h>
+#include <inttypes.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+
+#include "telemetry.h"
+#include "network.h"
+#include "udpclient.h"
+#include "packetizer.h"
+#include "backlog.h"
+#include "linkmon.h"
+#include "adapt.h"
+#include "conn.h"
+#include "timesync.h"
+#include "wsmsg.h"
+
+#define TAG "TELEMETRY"
+
+#ifndef CONFIG_TELEMETRY_PERIOD_MS
+#define CONFIG_TELEMETRY_PERIOD_MS 1000
+#endif
+
+/* Once per period, straight into a websocket send slot:
+ *   {"type":"telemetry","seq":42,"d":[12345,150112,...]}
+ * The values are positional. Their names go out in a schema message
+ *   {"type":"telemetry_schema","v":1,"period_ms":1000,"fields":["up_ms",...]}
+ * whenever the websocket comes up and every SCHEMA_EVERY frames after that.
+ * Counters are totals since boot, so a lost frame loses no events; the
+ * receiver takes differences for rates. Sizes (heap_*, stack_*) are in
+ * bytes: ESP-IDF's uxTaskGetStackHighWaterMark() counts bytes, not words. */
+
+#define TELEMETRY_VERSION 1
+#define SCHEMA_EVERY 60
+
+typedef enum {
+    T_UP_MS,
+    T_HEAP_FREE,
+    T_HEAP_MIN,
+    T_TASKS,
+    T_STACK_CAPTURE,    // Least unused stack in bytes, -1 if the task isn't running.
+    T_STACK_WS,         // Our websocket sender task.
+    T_STACK_UDP,
+    T_RATE,
+    T_SAMPLES,
+    T_DATAGRAMS,
+    T_PKT_LAT_AVG_US,
+    T_PKT_LAT_MAX_US,
+    T_AGC_DUTY,
+    T_UDP_SENT,
+    T_UDP_ERRORS,
+    T_UDP_DROPPED,
+    T_UDPQ_DROPPED,
+    T_UDPQ_HIGH,
+    T_WSQ_DROPPED,
+    T_WSQ_HIGH,
+    T_BL_STORED,
+    T_BL_EVICTED,
+    T_BL_FLUSHED,
+    T_RSSI,
+    T_RSSI_MIN,
+    T_LINK,
+    T_CONN_STATE,
+    T_OUTAGES,
+    T_ADAPT_LEVEL,
+    T_LOSS_PERMILLE,
+    T_SYNC_ERR_US,
+    T_SYNC_RTT_US,
+    T_WS_MSGS,
+    T_BUILD_US,         // Cost of the previous frame.
+    T_STACK_BACKLOG,
+    T_STACK_WS_CLIENT,  // esp_websocket_client's task, which runs the message handlers.
+    T_FIELDS,
+} field_t;
+
+static const char *field_names[T_FIELDS] = {
+    "up_ms", "heap_free", "heap_min", "tasks", "stack_capture", "stack_ws", "stack_udp",
+    "rate", "samples", "datagrams", "pkt_lat_avg_us", "pkt_lat_max_us", "agc_duty",
+    "udp_sent", "udp_errors", "udp_dropped", "udpq_dropped", "udpq_high", "wsq_dropped", "wsq_high",
+    "bl_stored", "bl_evicted", "bl_flushed", "rssi", "rssi_min", "link",
+    "conn_state", "outages", "adapt_level", "loss_permille", "sync_err_us", "sync_rtt_us",
+    "ws_msgs", "build_us", "stack_backlog", "stack_ws_client",
+};
+
+static volatile uint32_t agc_duty;
+static telemetry_stats_t stats;
+
+typedef struct {
+    char *p;
+    char *end;
+} out_t;
+
+static void put_str(out_t *o, const char *s)
+{
+    while (*s && o->p < o->end) *o->p++ = *s++;
+}
+
+static void put_int(out_t *o, int64_t v)
+{
+    char tmp[20];
+    int n = 0;
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0 && o->p < o->end) *o->p++ = '-';
+    while (n && o->p < o->end) *o->p++ = tmp[--n];
+}
+
+static int32_t stack_free(const char *name)
+{
+    TaskHandle_t h = xTaskGetHandle(name);
+    return h ? (int32_t)uxTaskGetStackHighWaterMark(h) : -1;
+}
+
+static void collect(int64_t v[T_FIELDS])
+{
+    packetizer_stats_t pk;
+    adapt_stats_t ad;
+    conn_stats_t cs;
+    wsmsg_stats_t wm;
+    txq_stats_t wq;
+
+    memset(v, 0, T_FIELDS * sizeof(v[0]));
+    v[T_UP_MS] = esp_timer_get_time() / 1000;
+    v[T_HEAP_FREE] = esp_get_free_heap_size();
+    v[T_HEAP_MIN] = esp_get_minimum_free_heap_size();
+    v[T_TASKS] = uxTaskGetNumberOfTasks();
+    v[T_STACK_CAPTURE] = stack_free("main_thread");
+    v[T_STACK_WS] = stack_free("websocket");
+    v[T_STACK_UDP] = stack_free("udp");
+    v[T_STACK_BACKLOG] = stack_free("backlog");
+    v[T_STACK_WS_CLIENT] = stack_free("websocket_task");
+
+    packetizer_get_stats(&pk, 0);
+    v[T_RATE] = packetizer_rate();
+    v[T_SAMPLES] = pk.samples;
+    v[T_DATAGRAMS] = pk.datagrams;
+    v[T_PKT_LAT_AVG_US] = pk.datagrams ? pk.latency_sum_us / pk.datagrams : 0;
+    v[T_PKT_LAT_MAX_US] = pk.latency_max_us;
+    v[T_AGC_DUTY] = agc_duty;
+
+#if CONFIG_STREAM_TRANSPORT_UDP
+    udp_tx_stats_t tx;
+    txq_stats_t uq;
+    // The first frames go out during the handshake, before the UDP task has
+    // set up its queue; txq_get_stats() reports zeros until then.
+    udp_get_tx_stats(&tx, 0);
+    udp_get_queue_stats(&uq, 0);
+    v[T_UDP_SENT] = tx.sent;
+    v[T_UDP_ERRORS] = tx.errors;
+    v[T_UDP_DROPPED] = tx.dropped;
+    v[T_UDPQ_DROPPED] = uq.dropped;
+    v[T_UDPQ_HIGH] = uq.high_water;
+#endif
+    ws_get_queue_stats(&wq, 0);
+    v[T_WSQ_DROPPED] = wq.dropped;
+    v[T_WSQ_HIGH] = wq.high_water;
+
+#if CONFIG_BACKLOG_ENABLE
+    backlog_stats_t bl;
+    backlog_get_stats(&bl, 0);
+    v[T_BL_STORED] = bl.stored;
+    v[T_BL_EVICTED] = bl.evicted;
+    v[T_BL_FLUSHED] = bl.flushed;
+#endif
+#if CONFIG_LINKMON_ENABLE
+    linkmon_stats_t lm;
+    linkmon_get_stats(&lm, 0);
+    v[T_RSSI] = lm.rssi;
+    v[T_RSSI_MIN] = lm.rssi_min;
+    v[T_LINK] = lm.quality;
+#endif
+
+    conn_get_stats(&cs);
+    adapt_get_stats(&ad);
+    v[T_CONN_STATE] = cs.state;
+    v[T_OUTAGES] = cs.outages;
+    v[T_ADAPT_LEVEL] = ad.level;
+    v[T_LOSS_PERMILLE] = (int64_t)(ad.loss * 1000);
+
+#if CONFIG_TIMESYNC_ENABLE
+    timesync_stats_t ts;
+    timesync_get_stats(&ts, 0);
+    v[T_SYNC_ERR_US] = ts.err_last_us;
+    v[T_SYNC_RTT_US] = ts.rtt_min_us;
+#endif
+    wsmsg_get_stats(&wm);
+    v[T_WS_MSGS] = wm.messages;
+    v[T_BUILD_US] = stats.build_last_us;
+}
+
+// The schema is what makes the frames readable, so it goes as a control message.
+static void send_schema(void)
+{
+    txq_slot_t *slot = ws_control_begin();
+    out_t o;
+
+    if (!slot) return;
+    o.p = (char *)slot->data;
+    o.end = o.p + slot->cap;
+    put_str(&o, "{\"type\":\"telemetry_schema\",\"v\":");
+    put_int(&o, TELEMETRY_VERSION);
+    put_str(&o, ",\"period_ms\":");
+    put_int(&o, CONFIG_TELEMETRY_PERIOD_MS);
+    put_str(&o, ",\"fields\":[");
+    for (int i = 0; i < T_FIELDS; i++) {
+        put_str(&o, i ? ",\"" : "\"");
+        put_str(&o, field_names[i]);
+        put_str(&o, "\"");
+    }
+    put_str(&o, "]}");
+    slot->len = o.p - (char *)slot->data;
+    ws_control_commit(slot);
+}
+
+static void send_frame(uint32_t seq)
+{
+    int64_t v[T_FIELDS];
+    int64_t start = esp_timer_get_time();
+    txq_slot_t *slot = ws_send_begin();
+    out_t o;
+
+    if (!slot) {
+        stats.dropped++;
+        return;
+    }
+    collect(v);
+    o.p = (char *)slot->data;
+    o.end = o.p + slot->cap;
+    put_str(&o, "{\"type\":\"telemetry\",\"seq\":");
+    put_int(&o, seq);
+    put_str(&o, ",\"d\":[");
+    for (int i = 0; i < T_FIELDS; i++) {
+        if (i) put_str(&o, ",");
+        put_int(&o, v[i]);
+    }
+    put_str(&o, "]}");
+    slot->len = o.p - (char *)slot->data;
+    stats.bytes_last = slot->len;
+    ws_send_commit(slot, 0);
+
+    uint32_t cost = (uint32_t)(esp_timer_get_time() - start);
+    stats.frames++;
+    stats.build_last_us = cost;
+    if (cost > stats.build_max_us) stats.build_max_us = cost;
+}
+
+static void telemetry_task(void *pvParameters)
+{
+    TickType_t wake = xTaskGetTickCount();
+    uint32_t seq = 0;
+    int was_up = 0;
+
+    while (1) {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(CONFIG_TELEMETRY_PERIOD_MS));
+        int up = conn_get_state() >= CONN_HANDSHAKE;
+        if (up && (!was_up || seq % SCHEMA_EVERY == 0)) send_schema();
+        was_up = up;
+        if (up) send_frame(seq++);
+    }
+}
+
+void telemetry_start(void)
+{
+    xTaskCreatePinnedToCore(telemetry_task, "telemetry", 3072, NULL, 1, NULL, 1);
+}
+
+void telemetry_set_agc(uint32_t duty)
+{
+    agc_duty = duty;
+}
+
+void telemetry_get_stats(telemetry_stats_t *out)
+{
+    *out = stats;
+}
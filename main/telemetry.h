@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t frames;
+    uint32_t dropped;       // No free websocket slot.
+    uint32_t build_last_us; // Collecting and encoding one frame.
+    uint32_t build_max_us;
+    uint32_t bytes_last;
+} telemetry_stats_t;
+
+void telemetry_start(void);
+// Gauges only main.c knows about.
+void telemetry_set_agc(uint32_t duty);
+void telemetry_get_stats(telemetry_stats_t *stats);
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "timesync.h"
+#include "conn.h"
+#include "network.h"
+
+#define TAG "TIMESYNC"
+
+#ifndef CONFIG_TIMESYNC_PERIOD_MS
+#define CONFIG_TIMESYNC_PERIOD_MS 1000
+#endif
+
+/* NTP style exchange over the websocket:
+ *   -> {"type":"time_sync","client":"ESP32","seq":7,"t1":<local us>}
+ *   <- {"type":"time_sync","seq":7,"t1":..,"t2":<server rx us>,"t3":<server tx us>}
+ * Server times are microseconds since the Unix epoch. Queueing on either side
+ * only ever adds delay, so out of each round of pings the one with the lowest
+ * round trip gives a sync point. A line fitted through the recent sync points
+ * gives the offset and the skew between the two clocks. */
+
+#define ROUND_PINGS 8
+#define MAX_POINTS 16
+// The first round of pings on each connection is sent back to back to get
+// synced quickly.
+#define BURST_MS 100
+// While no ping has ever been answered the interval doubles up to this, so a
+// server without time_sync support costs next to nothing.
+#define SILENT_MAX_MS 60000
+// The skew is only fitted over at least this long a span.
+#define MIN_FIT_SPAN_US 10000000
+#define MAX_SKEW_PPM 200
+// A sync point this far off the prediction means the server clock was set.
+#define STEP_US 20000
+
+typedef struct {
+    int64_t local_us;   // Midpoint of the exchange in local time.
+    int64_t offset_us;
+    uint32_t rtt_us;
+} sync_point_t;
+
+static portMUX_TYPE sync_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Estimate used by timesync_to_server(), written on the websocket task.
+static int synced = 0;
+static int64_t ref_local_us;
+static int64_t ref_offset_us;
+static double skew;
+
+// Outstanding ping.
+static uint32_t ping_seq = 0;
+static int64_t ping_t1 = 0;
+static int ping_pending = 0;
+
+// Best sample of the current round, websocket task only.
+static sync_point_t round_best;
+static int round_n = 0;
+
+static sync_point_t points[MAX_POINTS];
+static int n_points = 0;
+static int next_point = 0;
+
+static timesync_stats_t stats;
+
+static int64_t predict(int64_t local_us, int64_t ref_local, int64_t ref_offset, double k)
+{
+    return ref_offset + (int64_t)(k * (double)(local_us - ref_local));
+}
+
+// Least squares fit of offset over local time, evaluated at the newest point.
+static void fit(const sync_point_t *last)
+{
+    double mx = 0, my = 0, sxx = 0, sxy = 0, slope = 0;
+    int64_t span = 0;
+
+    for (int i = 0; i < n_points; i++) {
+        mx += (double)(points[i].local_us - last->local_us);
+        my += (double)(points[i].offset_us - last->offset_us);
+        if (last->local_us - points[i].local_us > span) span = last->local_us - points[i].local_us;
+    }
+    mx /= n_points;
+    my /= n_points;
+    for (int i = 0; i < n_points; i++) {
+        double dx = (double)(points[i].local_us - last->local_us) - mx;
+        double dy = (double)(points[i].offset_us - last->offset_us) - my;
+        sxx += dx * dx;
+        sxy += dx * dy;
+    }
+    if (span >= MIN_FIT_SPAN_US && sxx > 0) slope = sxy / sxx;
+    if (slope > MAX_SKEW_PPM * 1e-6) slope = MAX_SKEW_PPM * 1e-6;
+    if (slope < -MAX_SKEW_PPM * 1e-6) slope = -MAX_SKEW_PPM * 1e-6;
+
+    portENTER_CRITICAL(&sync_lock);
+    ref_local_us = last->local_us;
+    ref_offset_us = last->offset_us + (int64_t)(my - slope * mx);
+    skew = slope;
+    synced = 1;
+    stats.offset_us = ref_offset_us;
+    stats.skew_ppb = (int32_t)(slope * 1e9);
+    portEXIT_CRITICAL(&sync_lock);
+}
+
+static void add_point(const sync_point_t *p)
+{
+    int32_t err = 0;
+
+    if (synced) {
+        err = (int32_t)(p->offset_us - predict(p->local_us, ref_local_us, ref_offset_us, skew));
+        if (err > STEP_US || err < -STEP_US) {
+            ESP_LOGW(TAG, "Server clock moved by %" PRId32 " us, restarting", err);
+            n_points = 0;
+            next_point = 0;
+            stats.steps++;
+            err = 0;
+        }
+    }
+
+    points[next_point] = *p;
+    next_point = (next_point + 1) % MAX_POINTS;
+    if (n_points < MAX_POINTS) n_points++;
+    if (!synced) ESP_LOGI(TAG, "Synced, offset %" PRId64 " us, rtt %" PRIu32 " us", p->offset_us, p->rtt_us);
+    fit(p);
+
+    portENTER_CRITICAL(&sync_lock);
+    stats.points++;
+    stats.rtt_min_us = p->rtt_us;
+    stats.err_last_us = err;
+    if ((uint32_t)(err < 0 ? -err : err) > stats.err_max_us) stats.err_max_us = err < 0 ? -err : err;
+    portEXIT_CRITICAL(&sync_lock);
+}
+
+void timesync_on_message(const wsmsg_t *msg)
+{
+    int64_t t4 = esp_timer_get_time();
+    double seq, t1, t2, t3;
+    sync_point_t p;
+
+    if (!wsmsg_get_num(msg, "seq", &seq) || !wsmsg_get_num(msg, "t1", &t1) ||
+        !wsmsg_get_num(msg, "t2", &t2) || !wsmsg_get_num(msg, "t3", &t3))
+        return;
+
+    portENTER_CRITICAL(&sync_lock);
+    int match = ping_pending && (uint32_t)seq == ping_seq && (int64_t)t1 == ping_t1;
+    if (match) {
+        ping_pending = 0;
+        stats.pongs++;
+    }
+    portEXIT_CRITICAL(&sync_lock);
+    // A late reply to an earlier ping; that one was already counted as lost.
+    if (!match) return;
+
+    int64_t rtt = (t4 - (int64_t)t1) - ((int64_t)t3 - (int64_t)t2);
+    if (rtt < 0) rtt = 0;
+    p.local_us = (int64_t)t1 + (t4 - (int64_t)t1) / 2;
+    p.offset_us = (((int64_t)t2 - (int64_t)t1) + ((int64_t)t3 - t4)) / 2;
+    p.rtt_us = (uint32_t)rtt;
+    stats.rtt_last_us = p.rtt_us;
+
+    if (!round_n || p.rtt_us < round_best.rtt_us) round_best = p;
+    if (++round_n == ROUND_PINGS) {
+        add_point(&round_best);
+        round_n = 0;
+    }
+}
+
+static void send_ping(void)
+{
+    char json[96];
+    int64_t t1 = esp_timer_get_time();
+    uint32_t seq;
+
+    portENTER_CRITICAL(&sync_lock);
+    if (ping_pending) stats.lost++;
+    seq = ++ping_seq;
+    ping_t1 = t1;
+    ping_pending = 1;
+    stats.pings++;
+    portEXIT_CRITICAL(&sync_lock);
+
+    snprintf(json, sizeof(json), "{\"type\":\"time_sync\",\"client\":\"ESP32\",\"seq\":%" PRIu32 ",\"t1\":%" PRId64 "}",
+             seq, t1);
+    send_ws(json, 0);
+}
+
+static void timesync_task(void *pvParameters)
+{
+    int sent = 0;   // Pings on this connection.
+    int period_ms = CONFIG_TIMESYNC_PERIOD_MS;
+
+    while (1) {
+        // Once backed off there's no reason to believe a reconnect will answer.
+        int burst = sent < ROUND_PINGS && period_ms == CONFIG_TIMESYNC_PERIOD_MS;
+
+        vTaskDelay(pdMS_TO_TICKS(burst ? BURST_MS : period_ms));
+        // Nobody to answer without a websocket; the estimate itself stays valid.
+        if (conn_get_state() < CONN_HANDSHAKE) {
+            ping_pending = 0;
+            sent = 0;
+            continue;
+        }
+        if (stats.pongs) period_ms = CONFIG_TIMESYNC_PERIOD_MS;
+        else if (sent >= ROUND_PINGS && period_ms < SILENT_MAX_MS) {
+            period_ms = period_ms * 2 < SILENT_MAX_MS ? period_ms * 2 : SILENT_MAX_MS;
+            ESP_LOGI(TAG, "No time_sync answers yet, pinging every %d ms", period_ms);
+        }
+        send_ping();
+        sent++;
+    }
+}
+
+void timesync_start(void)
+{
+    xTaskCreatePinnedToCore(timesync_task, "timesync", 2560, NULL, 1, NULL, 1);
+}
+
+int timesync_to_server(int64_t local_us, int64_t *server_us)
+{
+    int64_t ref_local, ref_offset;
+    double k;
+
+    if (!synced) return 0;
+    portENTER_CRITICAL(&sync_lock);
+    ref_local = ref_local_us;
+    ref_offset = ref_offset_us;
+    k = skew;
+    portEXIT_CRITICAL(&sync_lock);
+    *server_us = local_us + predict(local_us, ref_local, ref_offset, k);
+    return 1;
+}
+
+void timesync_get_stats(timesync_stats_t *out, int reset)
+{
+    portENTER_CRITICAL(&sync_lock);
+    *out = stats;
+    out->synced = synced;
+    if (reset) {
+        stats.err_max_us = 0;
+        stats.lost = 0;
+    }
+    portEXIT_CRITICAL(&sync_lock);
+}
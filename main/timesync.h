@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include "wsmsg.h"
+
+typedef struct {
+    int synced;
+    int64_t offset_us;      // Server minus local time at the last sync point.
+    int32_t skew_ppb;       // Server clock rate relative to ours.
+    uint32_t rtt_last_us;
+    uint32_t rtt_min_us;    // Of the sample the last sync point came from.
+    int32_t err_last_us;    // Prediction error at the last sync point.
+    uint32_t err_max_us;
+    uint32_t pings;
+    uint32_t pongs;
+    uint32_t lost;
+    uint32_t steps;         // Server clock jumps that restarted the estimate.
+    uint32_t points;
+} timesync_stats_t;
+
+void timesync_start(void);
+// Handler for "time_sync" replies, called on the websocket task.
+void timesync_on_message(const wsmsg_t *msg);
+// Maps an esp_timer time to server time (us since the Unix epoch).
+// Returns 0 and leaves *server_us alone until the first sync.
+int timesync_to_server(int64_t local_us, int64_t *server_us);
+void timesync_get_stats(timesync_stats_t *stats, int reset);
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "txqueue.h"
+
+#define TAG "TXQ"
+
+/* Slots circulate between two FreeRTOS queues of slot pointers: free_q holds
+ * empty slots, ready_q holds committed messages in send order. A slot that is
+ * being filled or sent is in neither, so no message can be torn. */
+
+esp_err_t txq_init(txq_t *q, const char *name, int n_slots, size_t slot_size, txq_policy_t policy)
+{
+    uint8_t *mem = malloc(n_slots * slot_size);
+    txq_slot_t *slots = calloc(n_slots, sizeof(txq_slot_t));
+    QueueHandle_t free_q = xQueueCreate(n_slots, sizeof(txq_slot_t *));
+    // One spare entry for the NULL posted by txq_wake().
+    QueueHandle_t ready_q = xQueueCreate(n_slots + 1, sizeof(txq_slot_t *));
+
+    // Leave q zeroed on failure, so callers see it unset and can retry.
+    memset(q, 0, sizeof(*q));
+    if (!mem || !slots || !free_q || !ready_q) {
+        ESP_LOGE(TAG, "%s: out of memory", name);
+        free(mem);
+        free(slots);
+        if (free_q) vQueueDelete(free_q);
+        if (ready_q) vQueueDelete(ready_q);
+        return ESP_ERR_NO_MEM;
+    }
+
+    portMUX_INITIALIZE(&q->lock);
+    q->slots = slots;
+    q->ready_q = ready_q;
+    q->name = name;
+    q->policy = policy;
+    q->n_slots = n_slots;
+
+    for (int i = 0; i < n_slots; i++) {
+        txq_slot_t *slot = &q->slots[i];
+        slot->data = mem + i * slot_size;
+        slot->cap = slot_size;
+        xQueueSend(free_q, &slot, 0);
+    }
+    // Published last: a set free_q means the lock and slots are ready.
+    q->free_q = free_q;
+    return ESP_OK;
+}
+
+void txq_set_policy(txq_t *q, txq_policy_t policy)
+{
+    q->policy = policy;
+}
+
+txq_slot_t *txq_acquire(txq_t *q)
+{
+    txq_slot_t *slot = NULL;
+
+    if (!q->free_q) return NULL;
+    if (xQueueReceive(q->free_q, &slot, 0) != pdTRUE) {
+        // Full. Drop-oldest steals the head of the ready queue, drop-newest
+        // (or a ready queue drained by a concurrent consumer) rejects this one.
+        if (q->policy != TXQ_DROP_OLDEST || xQueueReceive(q->ready_q, &slot, 0) != pdTRUE)
+            slot = NULL;
+        else if (!slot && xQueueReceive(q->ready_q, &slot, 0) != pdTRUE)
+            slot = NULL; // Skipped a wake-up marker.
+        portENTER_CRITICAL(&q->lock);
+        q->stats.dropped++;
+        portEXIT_CRITICAL(&q->lock);
+        if (!slot) return NULL;
+    }
+    slot->len = 0;
+    slot->flags = 0;
+    return slot;
+}
+
+void txq_commit(txq_t *q, txq_slot_t *slot)
+{
+    if (!slot->len) {
+        txq_abort(q, slot);
+        return;
+    }
+    slot->stamp = esp_timer_get_time();
+    xQueueSend(q->ready_q, &slot, 0);
+
+    UBaseType_t waiting = uxQueueMessagesWaiting(q->ready_q);
+    portENTER_CRITICAL(&q->lock);
+    q->stats.enqueued++;
+    if (waiting > q->stats.high_water) q->stats.high_water = waiting;
+    portEXIT_CRITICAL(&q->lock);
+}
+
+void txq_abort(txq_t *q, txq_slot_t *slot)
+{
+    xQueueSend(q->free_q, &slot, 0);
+}
+
+int txq_push(txq_t *q, const void *hdr, size_t hdr_len, const void *dat, size_t len, uint8_t flags)
+{
+    txq_slot_t *slot;
+
+    if (!q->free_q) return 0;
+    if (hdr_len + len > q->slots[0].cap) {
+        ESP_LOGE(TAG, "%s: %u byte message exceeds slot size", q->name, (unsigned)(hdr_len + len));
+        portENTER_CRITICAL(&q->lock);
+        q->stats.dropped++;
+        portEXIT_CRITICAL(&q->lock);
+        return 0;
+    }
+    slot = txq_acquire(q);
+    if (!slot) return 0;
+
+    if (hdr_len) memcpy(slot->data, hdr, hdr_len);
+    memcpy(slot->data + hdr_len, dat, len);
+    slot->len = hdr_len + len;
+    slot->flags = flags;
+    txq_commit(q, slot);
+    return 1;
+}
+
+txq_slot_t *txq_receive(txq_t *q, TickType_t wait)
+{
+    txq_slot_t *slot = NULL;
+
+    if (!q->ready_q || xQueueReceive(q->ready_q, &slot, wait) != pdTRUE) return NULL;
+    return slot;
+}
+
+void txq_wake(txq_t *q)
+{
+    txq_slot_t *none = NULL;
+
+    // Uses the spare entry; if that is taken the consumer has work anyway.
+    if (q->ready_q) xQueueSendToFront(q->ready_q, &none, 0);
+}
+
+void txq_release(txq_t *q, txq_slot_t *slot, int sent)
+{
+    portENTER_CRITICAL(&q->lock);
+    if (sent) q->stats.sent++;
+    else q->stats.failed++;
+    portEXIT_CRITICAL(&q->lock);
+    xQueueSend(q->free_q, &slot, 0);
+}
+
+void txq_flush(txq_t *q)
+{
+    txq_slot_t *slot;
+
+    while (q->ready_q && xQueueReceive(q->ready_q, &slot, 0) == pdTRUE) {
+        if (!slot) continue;
+        portENTER_CRITICAL(&q->lock);
+        q->stats.dropped++;
+        portEXIT_CRITICAL(&q->lock);
+        xQueueSend(q->free_q, &slot, 0);
+    }
+}
+
+int txq_space(txq_t *q)
+{
+    return q->free_q ? (int)uxQueueMessagesWaiting(q->free_q) : 0;
+}
+
+void txq_get_stats(txq_t *q, txq_stats_t *stats, int reset)
+{
+    // Not set up yet, e.g. the UDP task hasn't started; its lock isn't either.
+    if (!q->free_q) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    portENTER_CRITICAL(&q->lock);
+    *stats = q->stats;
+    if (reset) memset(&q->stats, 0, sizeof(q->stats));
+    portEXIT_CRITICAL(&q->lock);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+typedef enum {
+    TXQ_DROP_OLDEST, // A full queue recycles the oldest pending slot.
+    TXQ_DROP_NEWEST, // A full queue rejects the incoming message.
+} txq_policy_t;
+
+#if CONFIG_TXQ_DROP_NEWEST
+#define TXQ_DEFAULT_POLICY TXQ_DROP_NEWEST
+#else
+#define TXQ_DEFAULT_POLICY TXQ_DROP_OLDEST
+#endif
+
+typedef struct {
+    uint32_t enqueued;
+    uint32_t sent;
+    uint32_t failed;      // Dequeued but the transport refused it.
+    uint32_t dropped;     // Lost to the drop policy.
+    uint32_t high_water;  // Most messages ever waiting at once.
+} txq_stats_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t cap;
+    size_t len;
+    uint8_t flags;
+    int64_t stamp;        // esp_timer time of the commit.
+} txq_slot_t;
+
+typedef struct {
+    const char *name;
+    txq_policy_t policy;
+    int n_slots;
+    txq_slot_t *slots;
+    QueueHandle_t free_q;
+    QueueHandle_t ready_q;
+    portMUX_TYPE lock;
+    txq_stats_t stats;
+} txq_t;
+
+esp_err_t txq_init(txq_t *q, const char *name, int n_slots, size_t slot_size, txq_policy_t policy);
+void txq_set_policy(txq_t *q, txq_policy_t policy);
+
+// Producer side. A slot from txq_acquire() must be committed or aborted.
+txq_slot_t *txq_acquire(txq_t *q);
+void txq_commit(txq_t *q, txq_slot_t *slot);
+void txq_abort(txq_t *q, txq_slot_t *slot);
+int txq_push(txq_t *q, const void *hdr, size_t hdr_len, const void *dat, size_t len, uint8_t flags);
+
+// Consumer side. Every received slot goes back with txq_release().
+txq_slot_t *txq_receive(txq_t *q, TickType_t wait);
+void txq_release(txq_t *q, txq_slot_t *slot, int sent);
+void txq_flush(txq_t *q);
+// Makes a consumer blocked in txq_receive() return NULL right away.
+void txq_wake(txq_t *q);
+
+// Free slots right now, without stealing from the ready queue.
+int txq_space(txq_t *q);
+void txq_get_stats(txq_t *q, txq_stats_t *stats, int reset);
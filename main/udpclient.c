@@ -1,4 +1,8 @@
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <inttypes.h>
 #include <sys/param.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -6,6 +10,7 @@
 #include "esp_system.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "esp_netif.h"
 
@@ -13,28 +18,462 @@
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
+#include "lwip/udp.h"
+#include "lwip/pbuf.h"
+#include "lwip/tcpip.h"
 
-#define HOST_IP_ADDR "192.168.179.11"
+#include "txqueue.h"
+#include "udpclient.h"
+#include "rtp.h"
+#include "settings.h"
+
+// Largest payload that fits a 1500 byte MTU without IP fragmentation.
+#define UDP_MAX_PAYLOAD 1472
+#define RAW_POOL_SLOTS 4
+
+#if !LWIP_SUPPORT_CUSTOM_PBUF
+#error "The raw UDP backend needs LWIP_SUPPORT_CUSTOM_PBUF"
+#endif
 
 static SemaphoreHandle_t shutdown_sema;
-static SemaphoreHandle_t send_sema;
 
 static const char *TAG = "UDP";
 
-static char send_data[2000] = {0};
-static int len_data = 0;
+// Slot flag: the datagram continues the block queued before it.
+#define UDP_FLAG_MORE 0x01
+
+static txq_t udp_q;
+
+
+#if CONFIG_UDP_BACKEND_RAW
+static volatile udp_backend_t backend = UDP_BACKEND_RAW;
+#elif CONFIG_UDP_BACKEND_INLINE
+static volatile udp_backend_t backend = UDP_BACKEND_INLINE;
+#else
+static volatile udp_backend_t backend = UDP_BACKEND_SOCKET;
+#endif
+
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static udp_tx_stats_t tx_stats;
+static int64_t last_tx_us = 0;
+
+/* Socket backend pacing: consecutive datagrams are spaced at least
+ * pace_gap_us apart so a backlog is drained smoothly instead of in one burst
+ * the Wi-Fi driver has to retry its way through. Waits shorter than a tick
+ * are done with a one-shot esp_timer that notifies the UDP task. */
+#define PACE_MIN_WAIT_US 200
+
+static volatile uint32_t pace_gap_us = 0;
+static esp_timer_handle_t pace_timer;
+static TaskHandle_t udp_task_handle;
+static volatile int udp_sock = -1;
+// Held by inline sends while they use udp_sock, and by the UDP task while it
+// retires the socket, so the socket is never closed under an inline send.
+static SemaphoreHandle_t sock_lock;
+
+#ifndef CONFIG_UDP_DSCP
+#define CONFIG_UDP_DSCP 0
+#endif
+
+// DSCP in the upper six bits of the IPv4 TOS byte.
+static volatile int dscp = CONFIG_UDP_DSCP;
+
+/* Raw API backend. Each slot is a custom pbuf followed by its own payload
+ * memory with room for the UDP/IP/link headers in front, so udp_sendto() can
+ * prepend headers in place and the Wi-Fi driver can send the slot by
+ * reference. The slot returns to the pool from the pbuf free callback, i.e.
+ * once the stack and the driver are both done with it. */
+typedef struct {
+    struct pbuf_custom pc;
+    int64_t queued;
+    uint8_t buf[PBUF_TRANSPORT + UDP_MAX_PAYLOAD] __attribute__((aligned(4)));
+} raw_slot_t;
+
+static raw_slot_t raw_slots[RAW_POOL_SLOTS];
+static QueueHandle_t raw_free_q;
+static SemaphoreHandle_t raw_sync;
+static struct udp_pcb *raw_pcb = NULL; // Only touched on the tcpip thread.
+
+/* Every datagram is encoded once and sent to each destination in turn.
+ * Destination 0 is the LedFx server (or the multicast group). */
+typedef struct {
+    struct sockaddr_in sa;
+    ip_addr_t ip;
+    u16_t port;
+} udp_dest_t;
+
+static udp_dest_t dests[UDP_MAX_DESTS];
+static udp_dest_stats_t dest_stats[UDP_MAX_DESTS];
+static int n_dests = 0;
+
+// queued is when the datagram was handed over, start/end bracket the send.
+static void record_tx(int64_t queued, int64_t start, int64_t end, int ok)
+{
+    uint32_t cpu = (uint32_t)(end - start);
+    uint32_t lat = (uint32_t)(end - queued);
+
+    portENTER_CRITICAL(&stats_lock);
+    if (ok) {
+        tx_stats.sent++;
+        if (last_tx_us) {
+            uint32_t gap = (uint32_t)(start - last_tx_us);
+            tx_stats.gaps++;
+            tx_stats.gap_sum_us += gap;
+            tx_stats.gap_sq_sum += (uint64_t)gap * gap;
+        }
+        last_tx_us = start;
+    }
+    else tx_stats.errors++;
+    tx_stats.lat_sum_us += lat;
+    if (lat > tx_stats.lat_max_us) tx_stats.lat_max_us = lat;
+    tx_stats.cpu_sum_us += cpu;
+    if (cpu > tx_stats.cpu_max_us) tx_stats.cpu_max_us = cpu;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+static void record_handoff(int64_t start, int64_t end, int dropped)
+{
+    portENTER_CRITICAL(&stats_lock);
+    tx_stats.cpu_sum_us += (uint32_t)(end - start);
+    if (dropped) tx_stats.dropped++;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void udp_get_tx_stats(udp_tx_stats_t *out, int reset)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *out = tx_stats;
+    if (reset) {
+        memset(&tx_stats, 0, sizeof(tx_stats));
+        last_tx_us = 0;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void udp_set_backend(udp_backend_t b)
+{
+    backend = b;
+}
+
+static void record_dest(int i, int ok, int len)
+{
+    portENTER_CRITICAL(&stats_lock);
+    if (ok) {
+        dest_stats[i].sent++;
+        dest_stats[i].bytes += len;
+    }
+    else dest_stats[i].errors++;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+int udp_get_dest_stats(udp_dest_stats_t *out, int max)
+{
+    int n = n_dests < max ? n_dests : max;
+
+    portENTER_CRITICAL(&stats_lock);
+    memcpy(out, dest_stats, n * sizeof(udp_dest_stats_t));
+    portEXIT_CRITICAL(&stats_lock);
+    return n;
+}
+
+static int add_dest(const char *ip, int port)
+{
+    udp_dest_t *d;
+
+    if (n_dests >= UDP_MAX_DESTS) {
+        ESP_LOGW(TAG, "Too many destinations, ignoring %s", ip);
+        return 0;
+    }
+    d = &dests[n_dests];
+    d->sa.sin_addr.s_addr = inet_addr(ip);
+    if (d->sa.sin_addr.s_addr == INADDR_NONE || !ipaddr_aton(ip, &d->ip)) {
+        ESP_LOGE(TAG, "Bad destination address %s", ip);
+        return 0;
+    }
+    d->sa.sin_family = AF_INET;
+    d->sa.sin_port = htons(port);
+    d->port = port;
+    memset(&dest_stats[n_dests], 0, sizeof(udp_dest_stats_t));
+    snprintf(dest_stats[n_dests].addr, sizeof(dest_stats[n_dests].addr), "%s:%d", ip, port);
+    n_dests++;
+    return 1;
+}
+
+// The server may be configured by name; UDP destinations need the address.
+static const char *resolve_host(const char *host)
+{
+    static char addr[16];
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo *res = NULL;
+
+    if (inet_addr(host) != INADDR_NONE) return host;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || !res) {
+        ESP_LOGE(TAG, "Unable to resolve %s", host);
+        return host;
+    }
+    inet_ntoa_r(((struct sockaddr_in *)res->ai_addr)->sin_addr, addr, sizeof(addr));
+    freeaddrinfo(res);
+    return addr;
+}
+
+// Port negotiated in the handshake, and a new one requested at runtime.
+static int negotiated_port = 0;
+static volatile int pending_port = 0;
+
+static void build_dests(int port)
+{
+    n_dests = 0;
+    negotiated_port = port;
+#if CONFIG_UDP_DEST_MULTICAST
+    add_dest(CONFIG_UDP_MULTICAST_GROUP, CONFIG_UDP_MULTICAST_PORT ? CONFIG_UDP_MULTICAST_PORT : port);
+#else
+    settings_t cfg;
+
+    settings_get(&cfg);
+    add_dest(resolve_host(cfg.server_host), port);
+#if CONFIG_UDP_DEST_LIST
+    // "ip[:port],ip[:port],..." where a missing port means the negotiated one.
+    char list[] = CONFIG_UDP_FANOUT_DESTS;
+    char *save = NULL;
+    for (char *tok = strtok_r(list, ", ", &save); tok; tok = strtok_r(NULL, ", ", &save)) {
+        char *colon = strchr(tok, ':');
+        int p = port;
+        if (colon) {
+            *colon = '\0';
+            p = atoi(colon + 1);
+        }
+        add_dest(tok, p);
+    }
+#endif
+#endif
+}
+
+// Moves every destination on the negotiated port over to a new one, in place
+// so the raw and inline backends never see a half-built list.
+static void change_port(int port)
+{
+    for (int i = 0; i < n_dests; i++) {
+        if (dests[i].port != negotiated_port) continue;
+        dests[i].sa.sin_port = htons(port);
+        dests[i].port = port;
+        char *colon = strrchr(dest_stats[i].addr, ':');
+        if (colon) snprintf(colon, sizeof(dest_stats[i].addr) - (colon - dest_stats[i].addr), ":%d", port);
+    }
+    ESP_LOGI(TAG, "Port %d -> %d", negotiated_port, port);
+    negotiated_port = port;
+}
+
+void udp_set_port(int port)
+{
+    pending_port = port;
+}
+
+static void raw_slot_free(struct pbuf *p)
+{
+    raw_slot_t *slot = (raw_slot_t *)p;
+    xQueueSend(raw_free_q, &slot, 0);
+}
+
+static void raw_open(void *ctx)
+{
+    raw_pcb = udp_new();
+    if (raw_pcb) raw_pcb->tos = dscp << 2;
+#if CONFIG_UDP_DEST_MULTICAST
+    if (raw_pcb) udp_set_multicast_ttl(raw_pcb, CONFIG_UDP_MULTICAST_TTL);
+#endif
+    xSemaphoreGive(raw_sync);
+}
+
+static void raw_close(void *ctx)
+{
+    if (raw_pcb) udp_remove(raw_pcb);
+    raw_pcb = NULL;
+    xSemaphoreGive(raw_sync);
+}
+
+static void raw_send(void *ctx)
+{
+    struct pbuf *p = ctx;
+    int64_t start = esp_timer_get_time();
+    int ok = 0;
+
+    if (raw_pcb) {
+        raw_pcb->tos = dscp << 2;
+        /* udp_sendto() prepends headers in place and the driver may keep the
+         * pbuf until transmitted, so the slot itself can only go out once.
+         * Extra destinations get a REF pbuf on the same payload, which lwIP
+         * sends with a separate header pbuf, and the slot goes out last. */
+        for (int i = n_dests - 1; i >= 0; i--) {
+            err_t err = ERR_MEM;
+            if (i == 0) {
+                err = udp_sendto(raw_pcb, p, &dests[0].ip, dests[0].port);
+            }
+            else {
+                struct pbuf *r = pbuf_alloc(PBUF_TRANSPORT, p->len, PBUF_REF);
+                if (r) {
+                    r->payload = p->payload;
+                    err = udp_sendto(raw_pcb, r, &dests[i].ip, dests[i].port);
+                    pbuf_free(r);
+                }
+            }
+            record_dest(i, err == ERR_OK, p->len);
+            if (err == ERR_OK) ok = 1;
+        }
+    }
+    int64_t queued = ((raw_slot_t *)p)->queued;
+    pbuf_free(p);
+    record_tx(queued, start, esp_timer_get_time(), ok);
+}
+
+static int send_udp_raw(char *dat, int len)
+{
+    raw_slot_t *slot;
+    struct pbuf *p;
+
+    if (!raw_free_q || xQueueReceive(raw_free_q, &slot, 0) != pdTRUE) return 0;
+
+    slot->pc.custom_free_function = raw_slot_free;
+    p = pbuf_alloced_custom(PBUF_TRANSPORT, len, PBUF_RAM, &slot->pc,
+                            slot->buf, sizeof(slot->buf));
+    if (!p) {
+        xQueueSend(raw_free_q, &slot, 0);
+        return 0;
+    }
+    memcpy(p->payload, dat, len);
+    slot->queued = esp_timer_get_time();
+    if (tcpip_try_callback(raw_send, p) != ERR_OK) {
+        pbuf_free(p); // Hands the slot back through raw_slot_free.
+        return 0;
+    }
+    return 1;
+}
+
+/* Inline backend: the producing task sends on the UDP task's socket itself.
+ * MSG_DONTWAIT keeps it from ever blocking the capture path; a datagram
+ * lwIP has no buffer for is dropped, as the stack already holds the older
+ * ones and there is nothing left to recycle. */
+static void send_udp_inline(char *dat, int len, int64_t start)
+{
+    int sock;
+    int sent = 0, blocked = 0;
+
+    // Only contended while the socket is being shut down; drop rather than wait.
+    if (!sock_lock || xSemaphoreTake(sock_lock, 0) != pdTRUE) {
+        record_handoff(start, esp_timer_get_time(), 1);
+        return;
+    }
+    sock = udp_sock;
+    if (sock < 0) {
+        xSemaphoreGive(sock_lock);
+        record_handoff(start, esp_timer_get_time(), 1);
+        return;
+    }
+    for (int i = 0; i < n_dests; i++) {
+        int err = sendto(sock, dat, len, MSG_DONTWAIT, (struct sockaddr *)&dests[i].sa, sizeof(dests[i].sa));
+        if (err < 0 && (errno == EWOULDBLOCK || errno == EAGAIN || errno == ENOMEM)) blocked++;
+        record_dest(i, err >= 0, len);
+        if (err >= 0) sent++;
+    }
+    xSemaphoreGive(sock_lock);
+    if (!sent && blocked) record_handoff(start, esp_timer_get_time(), 1);
+    else record_tx(start, start, esp_timer_get_time(), sent > 0);
+}
+
+static void send_udp_flags(char *dat, int len, uint8_t flags)
+{
+    int64_t start = esp_timer_get_time();
+    int dropped = 0;
+
+    if (len > UDP_MAX_PAYLOAD) len = UDP_MAX_PAYLOAD;
+    if (backend == UDP_BACKEND_INLINE) {
+        send_udp_inline(dat, len, start);
+        return;
+    }
+    if (backend == UDP_BACKEND_RAW) {
+        dropped = !send_udp_raw(dat, len);
+    }
+    else {
+        dropped = !txq_push(&udp_q, NULL, 0, dat, len, flags);
+    }
+    record_handoff(start, esp_timer_get_time(), dropped);
+}
 
 void send_udp(char *dat, int len) {
-    len_data = len;
-    //strncpy(send_data, dat, len);
-    for (int i = 0; i < len; i++)
-        send_data[i] = dat[i];
-    xSemaphoreGive(send_sema);
+    send_udp_flags(dat, len, 0);
+}
+
+void send_udp_more(char *dat, int len) {
+    send_udp_flags(dat, len, UDP_FLAG_MORE);
+}
+
+void udp_get_queue_stats(txq_stats_t *stats, int reset)
+{
+    txq_get_stats(&udp_q, stats, reset);
+}
+
+int udp_tx_space(void)
+{
+    if (backend == UDP_BACKEND_INLINE) return INT_MAX;   // Sent, or dropped, on the spot.
+    if (backend == UDP_BACKEND_RAW) return raw_free_q ? (int)uxQueueMessagesWaiting(raw_free_q) : 0;
+    return txq_space(&udp_q);
+}
+
+#if CONFIG_UDP_PAYLOAD_RTP && CONFIG_RTCP_SR
+// RTCP goes to the port above each RTP destination, from the socket.
+static void send_rtcp_sr(int sock)
+{
+    uint8_t buf[64];
+    size_t len = rtcp_write_sr(buf, sizeof(buf));
+
+    if (!len) return;
+    for (int i = 0; i < n_dests; i++) {
+        struct sockaddr_in sa = dests[i].sa;
+        sa.sin_port = htons(dests[i].port + 1);
+        sendto(sock, buf, len, 0, (struct sockaddr *)&sa, sizeof(sa));
+    }
+}
+#endif
+
+static void pace_wake(void *arg)
+{
+    xTaskNotifyGive(udp_task_handle);
+}
+
+static void pace_until(int64_t t)
+{
+    int64_t wait = t - esp_timer_get_time();
+
+    if (wait < PACE_MIN_WAIT_US) return;
+    esp_timer_stop(pace_timer);
+    if (esp_timer_start_once(pace_timer, wait) != ESP_OK) return;
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait / 1000) + 2);
+}
+
+static void apply_dscp(int sock, int *applied)
+{
+    int tos = dscp << 2;
+
+    if (tos == *applied) return;
+    if (setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
+        ESP_LOGW(TAG, "Unable to set TOS 0x%02x: errno %d", tos, errno);
+    }
+    *applied = tos;
+}
+
+void udp_set_dscp(int d)
+{
+    dscp = d & 0x3f;
+}
+
+void udp_set_pacing(uint32_t gap_us)
+{
+    pace_gap_us = gap_us;
 }
 
 void shutdown_socket()
 {
     xSemaphoreGive(shutdown_sema);
+    txq_wake(&udp_q);
 }
 
 void udp_client_task(void *pvParameters)
@@ -44,12 +483,16 @@ void udp_client_task(void *pvParameters)
     int udpPort = (int *)pvParameters;
 
     shutdown_sema = xSemaphoreCreateBinary();
-    send_sema = xSemaphoreCreateBinary();
+    if (!sock_lock) sock_lock = xSemaphoreCreateMutex();
+    udp_task_handle = xTaskGetCurrentTaskHandle();
+    if (!pace_timer) {
+        const esp_timer_create_args_t args = { .callback = pace_wake, .name = "udp_pace" };
+        esp_timer_create(&args, &pace_timer);
+    }
+    if (!udp_q.free_q)
+        txq_init(&udp_q, "udp", CONFIG_TXQ_UDP_SLOTS, UDP_MAX_PAYLOAD, TXQ_DEFAULT_POLICY);
 
-    struct sockaddr_in dest_addr;
-    dest_addr.sin_addr.s_addr = inet_addr(HOST_IP_ADDR);
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(udpPort);
+    build_dests(udpPort);
     addr_family = AF_INET;
     ip_protocol = IPPROTO_IP;
 
@@ -65,18 +508,78 @@ void udp_client_task(void *pvParameters)
     timeout.tv_sec = 10;
     timeout.tv_usec = 0;
     setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+#if CONFIG_UDP_DEST_MULTICAST
+    uint8_t ttl = CONFIG_UDP_MULTICAST_TTL;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+#endif
+    int tos_applied = 0;
+    apply_dscp(sock, &tos_applied);
+    xSemaphoreTake(sock_lock, portMAX_DELAY);
+    udp_sock = sock;
+    xSemaphoreGive(sock_lock);
+
+    // The raw pcb lives alongside the socket so the backend can be switched at runtime.
+    if (!raw_free_q) {
+        raw_free_q = xQueueCreate(RAW_POOL_SLOTS, sizeof(raw_slot_t *));
+        raw_sync = xSemaphoreCreateBinary();
+        for (int i = 0; i < RAW_POOL_SLOTS; i++) {
+            raw_slot_t *slot = &raw_slots[i];
+            xQueueSend(raw_free_q, &slot, 0);
+        }
+    }
+    tcpip_callback(raw_open, NULL);
+    xSemaphoreTake(raw_sync, portMAX_DELAY);
+
+    for (int i = 0; i < n_dests; i++)
+        ESP_LOGI(TAG, "Socket created, sending to %s", dest_stats[i].addr);
 
-    ESP_LOGI(TAG, "Socket created, sending to %s:%d", HOST_IP_ADDR, udpPort);
+#if CONFIG_UDP_PAYLOAD_RTP && CONFIG_RTCP_SR
+    int64_t last_sr = esp_timer_get_time();
+#endif
+    int64_t last_send = 0;
+    int send_failures = 0;
 
     while (1) {
-        if (xSemaphoreTake(send_sema, 100) == pdTRUE) {
+        txq_slot_t *slot = txq_receive(&udp_q, 100);
+        apply_dscp(sock, &tos_applied);
+        if (pending_port) {
+            change_port(pending_port);
+            pending_port = 0;
+        }
+        if (slot) {
             //ESP_LOGI(TAG, "Sending WS data");
-            int err = sendto(sock, send_data, len_data, 0, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-            if (err < 0) {
-                ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-                break;
+            // Pacing spaces blocks; the rest of a split block follows at once.
+            int more = slot->flags & UDP_FLAG_MORE;
+            if (pace_gap_us && !more) pace_until(last_send + pace_gap_us);
+            int64_t start = esp_timer_get_time();
+            if (!more) last_send = start;
+            int sent = 0;
+            for (int i = 0; i < n_dests; i++) {
+                int err = sendto(sock, slot->data, slot->len, 0, (struct sockaddr *)&dests[i].sa, sizeof(dests[i].sa));
+                record_dest(i, err >= 0, slot->len);
+                if (err >= 0) sent++;
+            }
+            record_tx(slot->stamp, start, esp_timer_get_time(), sent > 0);
+            txq_release(&udp_q, slot, sent > 0);
+            /* A failed send (ENOMEM while the driver is backed up, a route
+             * that is briefly gone) is counted and the socket kept; exiting
+             * would leave the connection streaming with nobody draining
+             * udp_q. Logged once per run of failures. */
+            if (n_dests && !sent) {
+                if (!send_failures++) ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
             }
+            else if (send_failures) {
+                ESP_LOGW(TAG, "Sending again after %d failed datagrams", send_failures);
+                send_failures = 0;
+            }
+        }
+
+#if CONFIG_UDP_PAYLOAD_RTP && CONFIG_RTCP_SR
+        if (esp_timer_get_time() - last_sr >= CONFIG_RTCP_SR_INTERVAL_MS * 1000LL) {
+            send_rtcp_sr(sock);
+            last_sr = esp_timer_get_time();
         }
+#endif
 
         if (xSemaphoreTake(shutdown_sema, 0) == pdTRUE) break;
 
@@ -103,7 +606,21 @@ void udp_client_task(void *pvParameters)
     }
 
     ESP_LOGI(TAG, "Shutting down socket...");
+    // Waits out an inline send still using the socket; later ones see -1.
+    xSemaphoreTake(sock_lock, portMAX_DELAY);
+    udp_sock = -1;
+    xSemaphoreGive(sock_lock);
+    txq_flush(&udp_q);
+    txq_stats_t qs;
+    txq_get_stats(&udp_q, &qs, 0);
+    ESP_LOGI(TAG, "Queue: %" PRIu32 " enqueued, %" PRIu32 " sent, %" PRIu32 " failed, %" PRIu32 " dropped, high water %" PRIu32,
+             qs.enqueued, qs.sent, qs.failed, qs.dropped, qs.high_water);
+    for (int i = 0; i < n_dests; i++)
+        ESP_LOGI(TAG, "%s: %" PRIu32 " sent, %" PRIu32 " errors", dest_stats[i].addr,
+                 dest_stats[i].sent, dest_stats[i].errors);
+    tcpip_callback(raw_close, NULL);
+    xSemaphoreTake(raw_sync, portMAX_DELAY);
     shutdown(sock, 0);
     close(sock);
     vTaskDelete(NULL);
-}
\ No newline at end of file
+}
@@ -1,3 +1,48 @@
+#include <stdint.h>
+#include "txqueue.h"
+
+typedef enum {
+    UDP_BACKEND_SOCKET, // BSD sockets from the UDP task.
+    UDP_BACKEND_RAW,    // lwIP raw API on the tcpip thread.
+    UDP_BACKEND_INLINE, // Non-blocking sendto from the producing task.
+} udp_backend_t;
+
+typedef struct {
+    uint32_t sent;
+    uint32_t errors;
+    uint32_t dropped;     // Block could not be handed over (no free buffer).
+    uint64_t cpu_sum_us;  // Hand-off plus send time over all packets.
+    uint32_t cpu_max_us;
+    uint64_t lat_sum_us;  // Hand-off to send complete.
+    uint32_t lat_max_us;
+    uint32_t gaps;        // Intervals between consecutive sends.
+    uint64_t gap_sum_us;
+    uint64_t gap_sq_sum;
+} udp_tx_stats_t;
+
+#define UDP_MAX_DESTS 4
+
+typedef struct {
+    char addr[24];        // "ip:port"
+    uint32_t sent;
+    uint32_t errors;
+    uint64_t bytes;
+} udp_dest_stats_t;
+
 void udp_client_task(void *pvParameters);
 void shutdown_socket();
-void send_udp(char *dat, int len);
\ No newline at end of file
+void send_udp(char *dat, int len);
+// Another datagram of the block just sent, queued without a pacing gap.
+void send_udp_more(char *dat, int len);
+void udp_set_backend(udp_backend_t b);
+// Switches destinations on the negotiated port to another one.
+void udp_set_port(int port);
+// DSCP code point for audio datagrams, 0 sends them best effort.
+void udp_set_dscp(int dscp);
+// Minimum spacing between blocks on the socket backend, 0 disables pacing.
+void udp_set_pacing(uint32_t gap_us);
+void udp_get_tx_stats(udp_tx_stats_t *stats, int reset);
+void udp_get_queue_stats(txq_stats_t *stats, int reset);
+// Datagrams the current backend can take without dropping one.
+int udp_tx_space(void);
+int udp_get_dest_stats(udp_dest_stats_t *stats, int max);
@@ -0,0 +1,299 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+
+#include "wsmsg.h"
+
+#define TAG "WSMSG"
+
+#define OP_CONT 0x00
+#define OP_TEXT 0x01
+
+typedef struct {
+    const char *type;
+    wsmsg_handler_t fn;
+} wsmsg_route_t;
+
+static wsmsg_route_t routes[WSMSG_MAX_HANDLERS];
+static int n_routes = 0;
+
+// Only touched from the websocket client task.
+static char buf[WSMSG_BUF_SIZE];
+static size_t buf_len;
+static size_t frame_base;   // Where the current websocket frame starts in buf.
+static int in_msg, overflow;
+static wsmsg_stats_t stats;
+
+int wsmsg_register(const char *type, wsmsg_handler_t fn)
+{
+    if (n_routes >= WSMSG_MAX_HANDLERS) {
+        ESP_LOGE(TAG, "Handler table full, can't route \"%s\"", type ? type : "");
+        return 0;
+    }
+    routes[n_routes].type = type;
+    routes[n_routes].fn = fn;
+    n_routes++;
+    return 1;
+}
+
+/* In-place parser for the flat JSON objects used as control messages.
+ * Strings are unescaped into the buffer they came from and terminated
+ * there; the JSON syntax around them always leaves room for the NUL. */
+
+static char *skip_ws(char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+    return p;
+}
+
+static int hex4(const char *p)
+{
+    int v = 0;
+
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+// p points at the opening quote. Returns the char after the closing quote.
+static char *parse_str(char *p, const char **out, int *len)
+{
+    char *src = p + 1, *dst = p + 1;
+
+    *out = dst;
+    while (*src && *src != '"') {
+        if (*src != '\\') {
+            *dst++ = *src++;
+            continue;
+        }
+        src++;
+        switch (*src) {
+        case '"': case '\\': case '/': *dst++ = *src; break;
+        case 'b': *dst++ = '\b'; break;
+        case 'f': *dst++ = '\f'; break;
+        case 'n': *dst++ = '\n'; break;
+        case 'r': *dst++ = '\r'; break;
+        case 't': *dst++ = '\t'; break;
+        case 'u': {
+            int c = hex4(src + 1);
+            if (c < 0) return NULL;
+            src += 4;
+            // Six escaped chars always fit the at most three UTF-8 bytes.
+            if (c >= 0xd800 && c <= 0xdfff) *dst++ = '?';
+            else if (c < 0x80) *dst++ = c;
+            else if (c < 0x800) {
+                *dst++ = 0xc0 | c >> 6;
+                *dst++ = 0x80 | (c & 0x3f);
+            }
+            else {
+                *dst++ = 0xe0 | c >> 12;
+                *dst++ = 0x80 | (c >> 6 & 0x3f);
+                *dst++ = 0x80 | (c & 0x3f);
+            }
+            break;
+        }
+        default:
+            return NULL;
+        }
+        src++;
+    }
+    if (*src != '"') return NULL;
+    *dst = 0;
+    *len = dst - *out;
+    return src + 1;
+}
+
+// Skips a nested object or array, p points at its opening bracket.
+static char *skip_nested(char *p)
+{
+    int depth = 0;
+
+    do {
+        if (*p == '"') {
+            for (p++; *p && *p != '"'; p++)
+                if (*p == '\\' && p[1]) p++;
+            if (!*p) return NULL;
+        }
+        else if (*p == '{' || *p == '[') depth++;
+        else if (*p == '}' || *p == ']') depth--;
+        else if (!*p) return NULL;
+        p++;
+    } while (depth);
+    return p;
+}
+
+static char *parse_value(char *p, wsmsg_field_t *f)
+{
+    char *end;
+
+    f->str = NULL;
+    f->len = 0;
+    f->num = 0;
+    if (*p == '"') {
+        f->type = WSMSG_STR;
+        return parse_str(p, &f->str, &f->len);
+    }
+    if (*p == '{' || *p == '[') {
+        f->type = WSMSG_RAW;
+        f->str = p;
+        end = skip_nested(p);
+        if (end) f->len = end - p;
+        return end;
+    }
+    if (!strncmp(p, "true", 4)) {
+        f->type = WSMSG_BOOL;
+        f->num = 1;
+        return p + 4;
+    }
+    if (!strncmp(p, "false", 5)) {
+        f->type = WSMSG_BOOL;
+        return p + 5;
+    }
+    if (!strncmp(p, "null", 4)) {
+        f->type = WSMSG_NULL;
+        return p + 4;
+    }
+    f->type = WSMSG_NUM;
+    f->num = strtod(p, &end);
+    return end == p ? NULL : end;
+}
+
+int wsmsg_parse(char *p, wsmsg_t *msg)
+{
+    msg->type = NULL;
+    msg->n = 0;
+
+    p = skip_ws(p);
+    if (*p++ != '{') return 0;
+    p = skip_ws(p);
+    if (*p == '}') return 1;
+
+    while (1) {
+        wsmsg_field_t tmp, *f = msg->n < WSMSG_MAX_FIELDS ? &msg->f[msg->n] : &tmp;
+        int key_len;
+
+        if (*p != '"' || !(p = parse_str(p, &f->key, &key_len))) return 0;
+        p = skip_ws(p);
+        if (*p++ != ':') return 0;
+        p = skip_ws(p);
+        if (!(p = parse_value(p, f))) return 0;
+        // Extra members are parsed for syntax but not kept.
+        if (f != &tmp) {
+            if (f->type == WSMSG_STR && !strcmp(f->key, "type")) msg->type = f->str;
+            msg->n++;
+        }
+        p = skip_ws(p);
+        if (*p == '}') return 1;
+        if (*p++ != ',') return 0;
+        p = skip_ws(p);
+    }
+}
+
+int wsmsg_parse_raw(const wsmsg_field_t *f, wsmsg_t *msg)
+{
+    // The char after the span was already consumed by the outer parse.
+    char *p = (char *)f->str;
+
+    if (f->type != WSMSG_RAW || *p != '{') return 0;
+    p[f->len] = 0;
+    return wsmsg_parse(p, msg);
+}
+
+const wsmsg_field_t *wsmsg_get(const wsmsg_t *msg, const char *key)
+{
+    for (int i = 0; i < msg->n; i++)
+        if (!strcmp(msg->f[i].key, key)) return &msg->f[i];
+    return NULL;
+}
+
+int wsmsg_get_num(const wsmsg_t *msg, const char *key, double *out)
+{
+    const wsmsg_field_t *f = wsmsg_get(msg, key);
+
+    if (!f || f->type != WSMSG_NUM) return 0;
+    *out = f->num;
+    return 1;
+}
+
+const char *wsmsg_get_str(const wsmsg_t *msg, const char *key)
+{
+    const wsmsg_field_t *f = wsmsg_get(msg, key);
+
+    return f && f->type == WSMSG_STR ? f->str : NULL;
+}
+
+static void dispatch(void)
+{
+    wsmsg_t msg;
+
+    buf[buf_len] = 0;
+    if (!wsmsg_parse(buf, &msg)) {
+        stats.parse_errors++;
+        ESP_LOGE(TAG, "Malformed message (%u bytes)", (unsigned)buf_len);
+        return;
+    }
+    for (int i = 0; i < n_routes; i++) {
+        if (msg.type ? routes[i].type && !strcmp(routes[i].type, msg.type) : !routes[i].type) {
+            routes[i].fn(&msg);
+            return;
+        }
+    }
+    stats.unhandled++;
+    ESP_LOGW(TAG, "No handler for \"%s\"", msg.type ? msg.type : "(untyped)");
+}
+
+/* esp_websocket_client hands over a frame longer than its buffer in several
+ * events with increasing payload_offset, and a fragmented message arrives
+ * as a text frame followed by continuation frames up to the one with FIN. */
+void wsmsg_feed(int op_code, const char *data, int len, int payload_len, int payload_offset, int fin)
+{
+    if (op_code == OP_TEXT && payload_offset == 0) {
+        in_msg = 1;
+        overflow = 0;
+        buf_len = 0;
+        frame_base = 0;
+    }
+    else if (op_code == OP_CONT && payload_offset == 0) {
+        frame_base = buf_len;
+    }
+    else if (op_code != OP_TEXT && op_code != OP_CONT) {
+        // Binary data frames end any message being assembled; control
+        // frames can be interleaved with fragments and are left alone.
+        if (op_code < 0x08) in_msg = 0;
+        return;
+    }
+    if (!in_msg) return;
+    if (op_code == OP_CONT || payload_offset) stats.fragments++;
+
+    size_t at = frame_base + payload_offset;
+    if (overflow || at + len >= sizeof(buf)) {
+        overflow = 1;
+    }
+    else {
+        memcpy(&buf[at], data, len);
+        buf_len = at + len;
+    }
+    if (payload_offset + len < payload_len || !fin) return;
+
+    in_msg = 0;
+    stats.messages++;
+    if (overflow) {
+        stats.overflows++;
+        ESP_LOGE(TAG, "Message exceeds %d bytes, dropped", WSMSG_BUF_SIZE - 1);
+        return;
+    }
+    dispatch();
+}
+
+void wsmsg_get_stats(wsmsg_stats_t *out)
+{
+    *out = stats;
+}
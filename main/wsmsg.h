@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+// Largest control message that can be reassembled, including the terminator.
+#define WSMSG_BUF_SIZE 1024
+#define WSMSG_MAX_FIELDS 16
+#define WSMSG_MAX_HANDLERS 8
+
+typedef enum {
+    WSMSG_NULL,
+    WSMSG_BOOL,
+    WSMSG_NUM,
+    WSMSG_STR,
+    WSMSG_RAW,      // Nested object or array, left unparsed.
+} wsmsg_type_t;
+
+typedef struct {
+    const char *key;
+    wsmsg_type_t type;
+    const char *str;    // STR: unescaped and terminated. RAW: not terminated.
+    int len;
+    double num;         // NUM and BOOL.
+} wsmsg_field_t;
+
+// Top level members of a JSON object, pointing into the receive buffer.
+// Only valid for the duration of the handler call.
+typedef struct {
+    const char *type;   // Value of "type", NULL if absent.
+    int n;
+    wsmsg_field_t f[WSMSG_MAX_FIELDS];
+} wsmsg_t;
+
+typedef struct {
+    uint32_t messages;
+    uint32_t fragments;     // Events that continued a partial message.
+    uint32_t overflows;
+    uint32_t parse_errors;
+    uint32_t unhandled;
+} wsmsg_stats_t;
+
+typedef void (*wsmsg_handler_t)(const wsmsg_t *msg);
+
+// type NULL registers the handler for messages without a "type" member.
+int wsmsg_register(const char *type, wsmsg_handler_t fn);
+// Feeds one websocket data event; complete text messages are dispatched
+// from here, i.e. on the websocket client task.
+void wsmsg_feed(int op_code, const char *data, int len, int payload_len, int payload_offset, int fin);
+int wsmsg_parse(char *buf, wsmsg_t *msg);
+// Parses a nested object member (WSMSG_RAW) of a message being handled.
+// Its strings are unescaped in place, so the raw span is consumed.
+int wsmsg_parse_raw(const wsmsg_field_t *f, wsmsg_t *msg);
+const wsmsg_field_t *wsmsg_get(const wsmsg_t *msg, const char *key);
+int wsmsg_get_num(const wsmsg_t *msg, const char *key, double *out);
+const char *wsmsg_get_str(const wsmsg_t *msg, const char *key);
+void wsmsg_get_stats(wsmsg_stats_t *stats);
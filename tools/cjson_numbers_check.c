@@ -0,0 +1,262 @@
+/* Host check for the vendored cJSON number printing and parsing.
+ *
+ * Prints millions of doubles with cJSON and with the sprintf code it
+ * replaced, and parses millions of number strings with cJSON and with the
+ * strtod code it replaced. Every printed value has to read back bit for bit,
+ * every parsed one has to match the old result bit for bit (value, valueint
+ * and the number of characters consumed). Also reports how the outputs
+ * compare in length and how long both versions take.
+ *
+ *     cc -O2 -I main -o /tmp/cjson_numbers_check tools/cjson_numbers_check.c main/cJSON.c -lm
+ *     /tmp/cjson_numbers_check [values per pattern, default 1000000]
+ *
+ * Exits with 1 if anything didn't round-trip or match.
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cJSON.h"
+
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rnd(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int saturate(double d)
+{
+    return d >= INT_MAX ? INT_MAX : d <= (double)INT_MIN ? INT_MIN : (int)d;
+}
+
+// print_number() before Grisu2.
+static int print_legacy(double d, char *out)
+{
+    int valueint = saturate(d);
+    double test = 0.0;
+    int len;
+
+    if (isnan(d) || isinf(d)) return sprintf(out, "null");
+    if (d == (double)valueint) return sprintf(out, "%d", valueint);
+    len = sprintf(out, "%1.15g", d);
+    if (sscanf(out, "%lg", &test) != 1 || test != d) len = sprintf(out, "%1.17g", d);
+    return len;
+}
+
+// parse_number() before the fast path: copy the number characters, strtod.
+static double parse_legacy(const char *in, size_t *len)
+{
+    char buf[64];
+    size_t i = 0;
+    char *end;
+    double d;
+
+    while (i < sizeof(buf) - 1 && in[i] && strchr("0123456789+-eE.", in[i])) {
+        buf[i] = in[i];
+        i++;
+    }
+    buf[i] = '\0';
+    d = strtod(buf, &end);
+    *len = end - buf;
+    return d;
+}
+
+/* Print patterns: raw bit patterns, short decimals, [0,1) fractions,
+ * subnormals and widened floats. */
+static double print_value(int pattern)
+{
+    uint64_t bits;
+    double d;
+
+    switch (pattern) {
+    case 0:
+        do {
+            bits = rnd();
+            memcpy(&d, &bits, sizeof(d));
+        } while (isnan(d) || isinf(d));
+        return d;
+    case 1:
+        return (double)((int64_t)(rnd() % 2000001) - 1000000) / 1000.0;
+    case 2:
+        return (double)(rnd() >> 11) / (double)(1ULL << 53);
+    case 3:
+        bits = rnd() & 0x000FFFFFFFFFFFFFULL;
+        memcpy(&d, &bits, sizeof(d));
+        return d;
+    default:
+        return (double)(float)((rnd() >> 40) * 1e-3);
+    }
+}
+
+// Parse patterns: %g at every precision, %.17e, integers, short decimals, mantissa/exponent pairs.
+static void parse_string(int pattern, char *out, size_t size)
+{
+    double d;
+
+    switch (pattern) {
+    case 0: {
+        uint64_t bits;
+        do {
+            bits = rnd();
+            memcpy(&d, &bits, sizeof(d));
+        } while (isnan(d) || isinf(d));
+        snprintf(out, size, "%.*g", (int)(rnd() % 17) + 1, d);
+        break;
+    }
+    case 1:
+        d = ldexp((double)(rnd() >> 11), (int)(rnd() % 300) - 200);
+        snprintf(out, size, "%.17e", d);
+        break;
+    case 2:
+        snprintf(out, size, "%" PRId64, (int64_t)rnd() >> (rnd() % 64));
+        break;
+    case 3:
+        snprintf(out, size, "%d.%0*d", (int)(rnd() % 100000) - 50000, (int)(rnd() % 6) + 1, (int)(rnd() % 1000));
+        break;
+    default:
+        snprintf(out, size, "%" PRIu64 "e%d", (rnd() >> (rnd() % 12)) | 1, (int)(rnd() % 140) - 70);
+        break;
+    }
+}
+
+#define PRINT_PATTERNS 5
+#define PARSE_PATTERNS 5
+#define BATCH 4096
+
+static long check_print(long n)
+{
+    static double values[BATCH];
+    char out[64], ref[64];
+    cJSON *item = cJSON_CreateNumber(0);
+    long fails = 0, shorter = 0, longer = 0, differ = 0;
+    long long bytes = 0, legacy_bytes = 0;
+    double t, t_new = 0, t_old = 0;
+
+    for (int pattern = 0; pattern < PRINT_PATTERNS; pattern++) {
+        for (long done = 0; done < n; done += BATCH) {
+            int batch = n - done < BATCH ? (int)(n - done) : BATCH;
+
+            for (int i = 0; i < batch; i++) values[i] = print_value(pattern);
+
+            t = now_s();
+            for (int i = 0; i < batch; i++) legacy_bytes += print_legacy(values[i], ref);
+            t_old += now_s() - t;
+
+            t = now_s();
+            for (int i = 0; i < batch; i++) {
+                cJSON_SetNumberValue(item, values[i]);
+                bytes += cJSON_PrintInto(item, out, sizeof(out), 0);
+            }
+            t_new += now_s() - t;
+
+            for (int i = 0; i < batch; i++) {
+                double back;
+                size_t len, old_len;
+
+                cJSON_SetNumberValue(item, values[i]);
+                len = cJSON_PrintInto(item, out, sizeof(out), 0);
+                old_len = print_legacy(values[i], ref);
+                back = strtod(out, NULL);
+                if (memcmp(&back, &values[i], sizeof(back)) && !(back == 0 && values[i] == 0)) {
+                    if (fails < 10) printf("print: %.17g printed as %s\n", values[i], out);
+                    fails++;
+                }
+                if (strcmp(out, ref)) differ++;
+                if (len < old_len) shorter++;
+                if (len > old_len) longer++;
+            }
+        }
+    }
+    cJSON_Delete(item);
+
+    n *= PRINT_PATTERNS;
+    printf("print %ld values: %ld did not round-trip, %ld differ from sprintf "
+           "(%ld shorter, %ld longer), %.2f vs %.2f bytes/value\n",
+           n, fails, differ, shorter, longer, (double)bytes / n, (double)legacy_bytes / n);
+    printf("print time: sprintf %.1f ns/value, cJSON %.1f ns/value\n", t_old * 1e9 / n, t_new * 1e9 / n);
+    return fails;
+}
+
+static long check_parse(long n)
+{
+    static char strings[BATCH][64];
+    long fails = 0;
+    double t, t_new = 0, t_old = 0;
+    volatile double sink;
+
+    for (int pattern = 0; pattern < PARSE_PATTERNS; pattern++) {
+        for (long done = 0; done < n; done += BATCH) {
+            int batch = n - done < BATCH ? (int)(n - done) : BATCH;
+
+            for (int i = 0; i < batch; i++) parse_string(pattern, strings[i], sizeof(strings[i]));
+
+            t = now_s();
+            for (int i = 0; i < batch; i++) {
+                size_t len;
+                sink = parse_legacy(strings[i], &len);
+            }
+            t_old += now_s() - t;
+
+            t = now_s();
+            for (int i = 0; i < batch; i++) {
+                cJSON *item = cJSON_Parse(strings[i]);
+                if (item) sink = item->valuedouble;
+                cJSON_Delete(item);
+            }
+            t_new += now_s() - t;
+
+            for (int i = 0; i < batch; i++) {
+                const char *end = NULL;
+                size_t len;
+                double d = parse_legacy(strings[i], &len);
+                cJSON *item = cJSON_ParseWithOpts(strings[i], &end, 0);
+
+                if (!item || memcmp(&item->valuedouble, &d, sizeof(d)) || item->valueint != saturate(d)
+                    || (size_t)(end - strings[i]) != len) {
+                    if (fails < 10)
+                        printf("parse: %s gave %.17g, strtod %.17g\n", strings[i], item ? item->valuedouble : NAN, d);
+                    fails++;
+                }
+                cJSON_Delete(item);
+            }
+        }
+    }
+
+    (void)sink;
+    n *= PARSE_PATTERNS;
+    printf("parse %ld strings: %ld differ from strtod\n", n, fails);
+    // cJSON_Parse also allocates and frees the item.
+    printf("parse time: strtod %.1f ns/string, cJSON_Parse %.1f ns/string\n", t_old * 1e9 / n, t_new * 1e9 / n);
+    return fails;
+}
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+    long fails;
+
+    if (n <= 0) {
+        fprintf(stderr, "usage: %s [values per pattern]\n", argv[0]);
+        return 2;
+    }
+    fails = check_print(n);
+    fails += check_parse(n);
+    return fails ? 1 : 0;
+}
@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+"""Stand-in for LedFx when running the latency probe on a bench.
+
+Accepts the device's websocket connection, answers the audio_stream_start
+handshake and time_sync pings, receives the audio (UDP, binary or afast
+websocket frames) and answers each latency_probe announcement with the time
+the marked sample arrived. Build the firmware with CONFIG_LATPROBE_ENABLE and
+point the device at this host:
+
+    pip install websockets
+    python3 tools/latprobe_receiver.py --port 8888 --udp-port 7777
+
+The device logs the capture/network/total histograms; this script prints
+each probe as it completes and a summary on Ctrl-C.
+"""
+
+import argparse
+import asyncio
+import base64
+import collections
+import json
+import struct
+import time
+
+import websockets
+
+MARKER = 0x8000
+# A marker and its announcement further apart than this belong to different probes.
+PAIR_WINDOW_US = 2000000
+# How far the device's synced clock may be ahead of ours.
+CLOCK_SLACK_US = 5000
+# A marker arriving later than this after its emit time belongs to a later
+# probe; keep it below the device's probe period (1 s by default).
+MAX_NETWORK_US = 500000
+EDGES_MS = [1, 2, 5, 10, 20, 50, 100, 200, 500]
+STAGES = ("capture", "network", "total")
+
+
+def now_us():
+    return time.time_ns() // 1000
+
+
+class Probes:
+    def __init__(self):
+        self.markers = collections.deque()    # Receive times of marked samples.
+        self.announced = collections.deque()  # (id, capture, emit, ws) without a marker yet.
+        self.results = {s: [] for s in STAGES}
+
+    def samples(self, payload, rx):
+        count = len(payload) // 2
+        for (v,) in struct.iter_unpack("<H", payload[:count * 2]):
+            if v & MARKER:
+                self.markers.append(rx)
+        self.expire(rx)
+
+    def expire(self, t):
+        while self.markers and t - self.markers[0] > PAIR_WINDOW_US:
+            self.markers.popleft()
+        while self.announced and t - self.announced[0][2] > PAIR_WINDOW_US:
+            print("probe %d: marked sample never arrived" % self.announced.popleft()[0])
+
+    async def announce(self, msg, ws):
+        self.announced.append((int(msg["id"]), int(msg["capture"]), int(msg["emit"]), ws))
+        await self.pair()
+
+    async def pair(self):
+        # Each announcement takes the first marker received after its emit
+        # time, so a lost marker or announcement only costs that one probe.
+        while self.markers and self.announced:
+            rx = self.markers[0]
+            pid, capture, emit, ws = self.announced[0]
+            if rx < emit - CLOCK_SLACK_US:
+                # Sent before this probe: its announcement was lost.
+                self.markers.popleft()
+                continue
+            later = self.announced[1][2] if len(self.announced) > 1 else None
+            if rx - emit > MAX_NETWORK_US or (later is not None and rx >= later - CLOCK_SLACK_US):
+                # Sent after the next probe: this one's marker was lost.
+                print("probe %d: marked sample never arrived" % pid)
+                self.announced.popleft()
+                continue
+            self.markers.popleft()
+            self.announced.popleft()
+            stages = (emit - capture, rx - emit, rx - capture)
+            for name, us in zip(STAGES, stages):
+                self.results[name].append(us)
+            print("probe %d: capture %.2f ms, network %.2f ms, total %.2f ms"
+                  % ((pid,) + tuple(us / 1000 for us in stages)))
+            await ws.send(json.dumps({"type": "latency_probe", "id": pid, "rx": rx}))
+
+    def summary(self):
+        for name in STAGES:
+            values = self.results[name]
+            if not values:
+                continue
+            hist = [0] * (len(EDGES_MS) + 1)
+            for us in values:
+                b = 0
+                while b < len(EDGES_MS) and us >= EDGES_MS[b] * 1000:
+                    b += 1
+                hist[b] += 1
+            buckets = " ".join("<%d:%d" % (e, h) for e, h in zip(EDGES_MS, hist)) + " more:%d" % hist[-1]
+            print("%-7s n=%d avg %.2f min %.2f max %.2f ms | %s"
+                  % (name, len(values), sum(values) / len(values) / 1000,
+                     min(values) / 1000, max(values) / 1000, buckets))
+
+
+probes = Probes()
+
+
+class UdpAudio(asyncio.DatagramProtocol):
+    def datagram_received(self, data, addr):
+        rx = now_us()
+        probes.samples(data, rx)
+        asyncio.ensure_future(probes.pair())
+
+
+async def handle_text(ws, text, udp_port):
+    t2 = now_us()
+    try:
+        msg = json.loads(text)
+    except ValueError:
+        return
+    kind = msg.get("type")
+    if kind == "audio_stream_start":
+        await ws.send(json.dumps({"connected": "true", "udp_port": udp_port}))
+    elif kind == "time_sync":
+        reply = {"type": "time_sync", "seq": msg["seq"], "t1": msg["t1"], "t2": t2}
+        reply["t3"] = now_us()
+        await ws.send(json.dumps(reply))
+    elif kind == "latency_probe":
+        await probes.announce(msg, ws)
+    elif kind == "afast":
+        probes.samples(base64.b64decode(msg["data"]), t2)
+        await probes.pair()
+
+
+async def handle_binary(data):
+    rx = now_us()
+    version = data[0]
+    header = 20 if version >= 2 else 12
+    probes.samples(data[header:], rx)
+    await probes.pair()
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", type=int, default=8888, help="websocket port")
+    parser.add_argument("--udp-port", type=int, default=7777, help="UDP audio port to hand out")
+    args = parser.parse_args()
+
+    async def handler(ws, path=None):
+        print("device connected from %s:%d" % ws.remote_address[:2])
+        async for frame in ws:
+            if isinstance(frame, bytes):
+                await handle_binary(frame)
+            else:
+                await handle_text(ws, frame, args.udp_port)
+        print("device disconnected")
+
+    loop = asyncio.get_running_loop()
+    await loop.create_datagram_endpoint(UdpAudio, local_addr=("0.0.0.0", args.udp_port))
+    async with websockets.serve(handler, "0.0.0.0", args.port):
+        print("listening on ws :%d, udp :%d" % (args.port, args.udp_port))
+        await asyncio.Future()
+
+
+if __name__ == "__main__":
+    try:
+        asyncio.run(main())
+    except KeyboardInterrupt:
+        probes.summary()